@@ -33,6 +33,7 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define BATCH_MAX     64 /* most requests replayed by one batch call (-b) */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned long)(p)) % ALIGNMENT) == 0)
@@ -64,9 +65,10 @@ typedef struct range_t {
 
 /* Characterizes a single trace operation (allocator request) */
 typedef struct {
-    enum { ALLOC, FREE, REALLOC } type; /* type of request */
+    enum { ALLOC, FREE, REALLOC, MEMALIGN } type; /* type of request */
     int index;                        /* index for free() to use later */
     size_t size;                      /* byte size of alloc/realloc request */
+    size_t align;                     /* alignment of memalign request */
 } traceop_t;
 
 /* Holds the information for one trace file*/
@@ -105,6 +107,11 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    size_t peak;     /* largest heap size (bytes) while running the trace */
+    size_t final;    /* heap size (bytes) at the end of the trace */
+    size_t resident; /* bytes of the heap resident in memory at the end */
+    size_t sbrks;    /* number of mem_sbrk calls ... */
+    size_t sbrk_bytes; /* ... and the bytes they asked for */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -141,6 +148,10 @@ int verbose = 1;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
 int onetime_flag = 0;
 
+/* if set, runs of requests are replayed by mm_malloc_batch / mm_free_batch (-b) */
+static int batch_mode = 0;
+static void *batch_ptrs[BATCH_MAX];
+
 /* by default, no timeouts */
 static int set_timeout = 0;
 
@@ -171,6 +182,7 @@ static void clear_ranges(range_t **ranges);
 /* These functions implement the debugging code */
 static void init_random_data(void);
 static void check_index(const trace_t *trace, int opnum, int index);
+static int batch_run(const trace_t *trace, int opnum);
 static void randomize_block(trace_t *trace, int index);
 
 /* These functions read, allocate, and free storage for traces */
@@ -246,11 +258,24 @@ static void run_tests(int num_tracefiles, const char *tracedir,
             if (verbose > 1)
                 printf("efficiency, ");
             mm_stats[i].util = eval_mm_util(trace, i);
+            mm_stats[i].peak = mem_peak_heapsize();
+            mm_stats[i].final = mem_heapsize();
+            mm_stats[i].resident = mem_resident();
+            mm_stats[i].sbrks = mem_sbrk_calls();
+            mm_stats[i].sbrk_bytes = mem_sbrk_bytes();
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1)
                 printf("and performance.\n");
             mm_stats[i].secs = fsecs(eval_mm_speed, speed_params);
+
+            /* how often the heap lock was taken (0 unless thread-safe) */
+            if (verbose > 1) {
+                unsigned long acquired, contended;
+                mm_lock_stats(&acquired, &contended);
+                printf("heap lock: %lu acquired, %lu contended\n",
+                       acquired, contended);
+            }
         }
 
         free_trace(trace);
@@ -276,6 +301,7 @@ int main(int argc, char **argv)
     speed_t speed_params;      /* input parameters to the xx_speed routines */
 
     int run_libc = 0;     /* If set, run libc malloc (set by -l) */
+    int run_order = 0;    /* If set, run mm malloc with the other free-list order (set by -o) */
     int autograder = 0;   /* if set then called by autograder (-A) */
     int checkpoint = 0;
 
@@ -291,7 +317,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpVAlD")) != EOF) {
+    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpVAlDob")) != EOF) {
         switch (c) {
 
         case 'A': /* Hidden Autolab driver argument */
@@ -332,6 +358,14 @@ int main(int argc, char **argv)
             run_libc = 1;
             break;
 
+        case 'b': /* Replay runs of requests by the batch calls */
+            batch_mode = 1;
+            break;
+
+        case 'o': /* Run mm malloc with the other free-list order as well */
+            run_order = 1;
+            break;
+
         case 'V': /* Increase verbosity level */
             verbose += 1;
             break;
@@ -448,6 +482,33 @@ int main(int argc, char **argv)
         }
     }
 
+    /*
+     * Optionally run mm malloc again with the other free-list order
+     * (tail insertion or address order) and compare the utilization
+     */
+    if (run_order && verbose && !onetime_flag) {
+        stats_t *order_stats;
+        sum_stats_t order_sum_stats;
+        int addr = mm_set_order(0);
+
+        order_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+        if (order_stats == NULL)
+            unix_error("order_stats calloc in main failed");
+
+        mm_set_order(!addr);
+        run_tests(num_tracefiles, tracedir, tracefiles, order_stats,
+                  ranges, &speed_params);
+        mm_set_order(addr);
+
+        printf("Results for mm malloc with %s free lists:\n",
+               addr ? "tail-inserted" : "address-ordered");
+        printresults(num_tracefiles, order_stats, &order_sum_stats);
+        printf("\nComparison of free-list order: util %s/%s = %.1f%% / %.1f%%\n\n",
+               addr ? "address" : "tail", addr ? "tail" : "address",
+               global_mm_sum_stats.util, order_sum_stats.util);
+        free(order_stats);
+    }
+
     /* Optionally compare the performance of mm and libc */
     if (run_libc) {
         printf("Comparison with libc malloc: mm/libc = %.0f Kops / %.0f Kops = %.2f\n", 
@@ -606,9 +667,11 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap,
+       or within an area mapped by mem_map */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !mem_in_map(lo, hi)) {
         malloc_error(trace, opnum,
                      "Payload (%p:%p) lies outside heap (%p:%p)",
                      lo, hi, mem_heap_lo(), mem_heap_hi());
@@ -741,6 +804,25 @@ static void check_index(const trace_t *trace, int opnum, int index) {
     }
 }
 
+/*
+ * batch_run - In batch mode, return how many requests from opnum on
+ *     are replayed by one batch call: a run of mallocs of one size,
+ *     or a run of frees (at most BATCH_MAX). Otherwise return 1.
+ */
+static int batch_run(const trace_t *trace, int opnum)
+{
+    const traceop_t *op = &trace->ops[opnum];
+    int n = 1;
+
+    if (!batch_mode || (op->type != ALLOC && op->type != FREE))
+        return 1;
+    while (opnum + n < trace->num_ops && n < BATCH_MAX &&
+           trace->ops[opnum+n].type == op->type &&
+           (op->type == FREE || trace->ops[opnum+n].size == op->size))
+        n++;
+    return n;
+}
+
 /**********************************************
  * The following routines manipulate tracefiles
  *********************************************/
@@ -754,7 +836,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     FILE *tracefile;
     trace_t *trace;
     char type[MAXLINE];
-    int index, size;
+    int index, size, align;
     int max_index = 0;
     int op_index;
 
@@ -824,6 +906,14 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
             trace->ops[op_index].size = size;
             max_index = (index > max_index) ? index : max_index;
             break;
+        case 'm': /* m <id> <size> <align> */
+            r = fscanf(tracefile, "%u %u %u", &index, &size, &align);
+            trace->ops[op_index].type = MEMALIGN;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            trace->ops[op_index].align = align;
+            max_index = (index > max_index) ? index : max_index;
+            break;
         case 'f':
             r = fscanf(tracefile, "%ud", &index);
             trace->ops[op_index].type = FREE;
@@ -881,7 +971,7 @@ static void free_trace(trace_t *trace)
  */
 static int eval_mm_valid(trace_t *trace, range_t **ranges)
 {
-    int i;
+    int i, k, n;
     int index;
     size_t size;
     char *newp;
@@ -921,9 +1011,38 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
+        case MEMALIGN: /* mm_memalign */
+
+            /* In batch mode, allocate the run at once, then check each block */
+            if ((n = batch_run(trace, i)) > 1) {
+                if (mm_malloc_batch(size, n, batch_ptrs) != (size_t)n) {
+                    malloc_error(trace, i, "mm_malloc_batch failed.");
+                    return 0;
+                }
+                for (k = 0; k < n; k++) {
+                    index = trace->ops[i+k].index;
+                    if (add_range(ranges, batch_ptrs[k], size, trace, i+k, index) == 0)
+                        return 0;
+                    trace->blocks[index] = batch_ptrs[k];
+                    trace->block_sizes[index] = size;
+                    randomize_block(trace, index);
+                }
+                i += n - 1;
+                break;
+            }
 
             /* Call the student's malloc */
-            if ((p = mm_malloc(size)) == NULL) {
+            if (trace->ops[i].type == MEMALIGN) {
+                if ((p = mm_memalign(trace->ops[i].align, size)) == NULL) {
+                    malloc_error(trace, i, "mm_memalign failed.");
+                    return 0;
+                }
+                if ((size_t)p % trace->ops[i].align != 0) {
+                    malloc_error(trace, i, "mm_memalign returned %p, not aligned to %zu bytes.",
+                                 p, trace->ops[i].align);
+                    return 0;
+                }
+            } else if ((p = mm_malloc(size)) == NULL) {
                 malloc_error(trace, i, "mm_malloc failed.");
                 return 0;
             }
@@ -985,6 +1104,23 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
             break;
 
         case FREE: /* mm_free */
+            /* In batch mode, free the run at once */
+            if ((n = batch_run(trace, i)) > 1) {
+                for (k = 0; k < n; k++) {
+                    index = trace->ops[i+k].index;
+                    check_index(trace, i+k, index);
+                    if (index == -1) {
+                        batch_ptrs[k] = 0;
+                    } else {
+                        batch_ptrs[k] = trace->blocks[index];
+                        remove_range(ranges, batch_ptrs[k]);
+                    }
+                }
+                mm_free_batch(batch_ptrs, n);
+                i += n - 1;
+                break;
+            }
+
             check_index(trace, i, index);
 
             /* Remove region from list and call student's free function */
@@ -1013,15 +1149,15 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
  *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   package on the trace. The heap size counts the areas mapped by
+ *   mem_map() too, and since those may be released, the largest heap
+ *   size during the trace (its high water mark) is used.
  *
  *   A higher number is better: 1 is optimal.
  */
 static double eval_mm_util(trace_t *trace, int tracenum)
 {
-    int i;
+    int i, k, n;
     int index;
     int size, newsize, oldsize;
     int max_total_size = 0;
@@ -1040,10 +1176,26 @@ static double eval_mm_util(trace_t *trace, int tracenum)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_alloc */
+        case MEMALIGN: /* mm_memalign */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
 
-            if ((p = mm_malloc(size)) == NULL) {
+            if ((n = batch_run(trace, i)) > 1) {
+                if (mm_malloc_batch(size, n, batch_ptrs) != (size_t)n) {
+                    app_error("trace %d: mm_malloc_batch failed in eval_mm_util",
+                              tracenum);
+                }
+                for (k = 0; k < n; k++) {
+                    trace->blocks[trace->ops[i+k].index] = batch_ptrs[k];
+                    trace->block_sizes[trace->ops[i+k].index] = size;
+                }
+                total_size += n * size;
+                i += n - 1;
+                break;
+            }
+
+            if ((p = trace->ops[i].type == MEMALIGN ?
+                 mm_memalign(trace->ops[i].align, size) : mm_malloc(size)) == NULL) {
                 app_error("trace %d: mm_malloc failed in eval_mm_util",
                           tracenum);
             }
@@ -1074,6 +1226,17 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             break;
 
         case FREE: /* mm_free */
+            if ((n = batch_run(trace, i)) > 1) {
+                for (k = 0; k < n; k++) {
+                    index = trace->ops[i+k].index;
+                    batch_ptrs[k] = index < 0 ? 0 : trace->blocks[index];
+                    total_size -= index < 0 ? 0 : trace->block_sizes[index];
+                }
+                mm_free_batch(batch_ptrs, n);
+                i += n - 1;
+                break;
+            }
+
             index = trace->ops[i].index;
             if(index < 0) {
                 size = 0;
@@ -1100,7 +1263,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 
     printf(".");
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return ((double)max_total_size / (double)mem_peak_heapsize());
 }
 
 
@@ -1110,7 +1273,7 @@ static double eval_mm_util(trace_t *trace, int tracenum)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index, size, newsize;
+    int i, k, n, index, size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
     reinit_trace(trace);
@@ -1127,11 +1290,27 @@ static void eval_mm_speed(void *ptr)
         case ALLOC: /* mm_malloc */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
+            if ((n = batch_run(trace, i)) > 1) {
+                if (mm_malloc_batch(size, n, batch_ptrs) != (size_t)n)
+                    app_error("mm_malloc_batch error in eval_mm_speed");
+                for (k = 0; k < n; k++)
+                    trace->blocks[trace->ops[i+k].index] = batch_ptrs[k];
+                i += n - 1;
+                break;
+            }
             if ((p = mm_malloc(size)) == NULL)
                 app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
             break;
 
+        case MEMALIGN: /* mm_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = mm_memalign(trace->ops[i].align, size)) == NULL)
+                app_error("mm_memalign error in eval_mm_speed");
+            trace->blocks[index] = p;
+            break;
+
         case REALLOC: /* mm_realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1142,6 +1321,15 @@ static void eval_mm_speed(void *ptr)
             break;
 
         case FREE: /* mm_free */
+            if ((n = batch_run(trace, i)) > 1) {
+                for (k = 0; k < n; k++) {
+                    index = trace->ops[i+k].index;
+                    batch_ptrs[k] = index < 0 ? 0 : trace->blocks[index];
+                }
+                mm_free_batch(batch_ptrs, n);
+                i += n - 1;
+                break;
+            }
             index = trace->ops[i].index;
             if(index < 0) {
                 block = 0;
@@ -1180,6 +1368,14 @@ static int eval_libc_valid(trace_t *trace)
             trace->blocks[trace->ops[i].index] = p;
             break;
 
+        case MEMALIGN: /* posix_memalign */
+            if (posix_memalign((void **)&p, trace->ops[i].align, trace->ops[i].size) != 0) {
+                malloc_error(trace, i, "libc posix_memalign failed");
+                unix_error("System message");
+            }
+            trace->blocks[trace->ops[i].index] = p;
+            break;
+
         case REALLOC: /* realloc */
             newsize = trace->ops[i].size;
             oldp = trace->blocks[trace->ops[i].index];
@@ -1230,6 +1426,14 @@ static void eval_libc_speed(void *ptr)
             trace->blocks[index] = p;
             break;
 
+        case MEMALIGN: /* posix_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if (posix_memalign((void **)&p, trace->ops[i].align, size) != 0)
+                unix_error("posix_memalign failed in eval_libc_speed");
+            trace->blocks[index] = p;
+            break;
+
         case REALLOC: /* realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1276,8 +1480,9 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
     char wstr;
 
     /* Print the individual results for each trace */
-    printf("  %2s%6s %5s%8s%9s  %s\n",
-           "valid", "util", "ops", "secs", "Kops", "trace");
+    printf("  %2s%6s%8s %5s%8s%9s%8s%8s%7s%8s  %s\n",
+           "valid", "util", "residK", "ops", "secs", "Kops", "peakK", "finalK",
+           "sbrks", "sbrkK", "trace");
     for (i=0; i < n; i++) {
         if (stats[i].valid) {
             switch(stats[i].weight)
@@ -1311,6 +1516,12 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
             else
                 printf(" %6s", "--");
 
+            /* resident heap in KB, '--' for libc */
+            if (stats[i].peak > 0)
+                printf("%8lu", (unsigned long)(stats[i].resident >> 10));
+            else
+                printf("%8s", "--");
+
             /* print '--' if perf isn't weighted */
             if(stats[i].weight == WNONE || stats[i].weight == WALL
                || stats[i].weight == WPERF)
@@ -1319,6 +1530,20 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
             else
                 printf("%8s%10s%6s", "--", "--", "--");
 
+            /* heap sizes in KB, '--' for libc */
+            if (stats[i].peak > 0)
+                printf("%8lu%8lu", (unsigned long)(stats[i].peak >> 10),
+                       (unsigned long)(stats[i].final >> 10));
+            else
+                printf("%8s%8s", "--", "--");
+
+            /* mem_sbrk calls and KB, '--' for libc */
+            if (stats[i].peak > 0)
+                printf("%7lu%8lu", (unsigned long)stats[i].sbrks,
+                       (unsigned long)(stats[i].sbrk_bytes >> 10));
+            else
+                printf("%7s%8s", "--", "--");
+
             printf(" %s\n", stats[i].filename);
 
             if(stats[i].weight == WALL || stats[i].weight == WPERF)
@@ -1429,7 +1654,7 @@ void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
  */
 static void usage(void)
 {
-    fprintf(stderr, "Usage: mdriver [-hlVdD] [-f <file>]\n");
+    fprintf(stderr, "Usage: mdriver [-hlobVdD] [-f <file>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-p         Calculate Checkpoint Score.\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
@@ -1438,6 +1663,8 @@ static void usage(void)
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-o         Run mm malloc with the other free-list order as well.\n");
+    fprintf(stderr, "\t-b         Replay runs of same-size mallocs / of frees by mm_malloc_batch / mm_free_batch.\n");
     fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
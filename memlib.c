@@ -3,6 +3,7 @@
  *						allows us to interleave calls from the student's malloc package 
  *						with the system's malloc package in libc.
  */
+#define _GNU_SOURCE /* for mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -20,6 +21,19 @@
 static char *heap;
 static char *mem_brk;
 static char *mem_max_addr;
+/* break points of the other regions, each MAX_HEAP bytes after the previous */
+static char *region_brk[MEM_NREGION];
+/* separately mapped areas (see mem_map), and their total size */
+static struct { void *addr; size_t size; } maps[MEM_NMAP];
+static size_t mem_mapped;
+/* the most bytes in use (heap regions plus mapped areas) at any time */
+static size_t mem_peak;
+/* number of calls to mem_sbrk (any region) and the bytes they asked for */
+static size_t sbrk_calls;
+static size_t sbrk_bytes;
+
+static void mem_update_peak(void);
+static void mem_unmap_all(void);
 
 /* 
  * mem_init - initialize the memory system model
@@ -27,20 +41,24 @@ static char *mem_max_addr;
 void mem_init(void){
 	int dev_zero = open("/dev/zero", O_RDWR);
 	heap = mmap((void *)0x800000000, /* suggested start*/
-			MAX_HEAP,				/* length */
+			(size_t)MAX_HEAP * MEM_NREGION,	/* length */
 			PROT_WRITE,				/* permissions */
-			MAP_PRIVATE,			/* private or shared? */
+			MAP_PRIVATE | MAP_NORESERVE,	/* private or shared? */
 			dev_zero,				/* fd */
 			0);						/* offset (dunno) */
 	mem_max_addr = heap + MAX_HEAP;
 	mem_brk = heap;					/* heap is empty initially */
+	mem_peak = 0;
+	for (int r = 1; r < MEM_NREGION; r++)
+		region_brk[r] = heap + (size_t)r * MAX_HEAP;
 }
 
 /* 
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void){
-	munmap(heap, MAX_HEAP);
+	mem_unmap_all();
+	munmap(heap, (size_t)MAX_HEAP * MEM_NREGION);
 }
 
 /*
@@ -48,6 +66,12 @@ void mem_deinit(void){
  */
 void mem_reset_brk(){
 	mem_brk = heap;
+	for (int r = 1; r < MEM_NREGION; r++)
+		region_brk[r] = heap + (size_t)r * MAX_HEAP;
+	mem_unmap_all();
+	mem_peak = 0;
+	sbrk_calls = 0;
+	sbrk_bytes = 0;
 }
 
 /* 
@@ -67,9 +91,216 @@ void *mem_sbrk(int incr) {
 	}
 
 	mem_brk += incr;
+	sbrk_calls++;
+	sbrk_bytes += incr;
+	mem_update_peak();
+	return (void *)old_brk;
+}
+
+/*
+ * mem_region_sbrk - mem_sbrk for the r-th region (region 0 is the heap
+ *		of mem_sbrk). Regions grow independently, so callers holding
+ *		different locks may extend different regions at the same time.
+ */
+void *mem_region_sbrk(int r, int incr) {
+	if (r == 0)
+		return mem_sbrk(incr);
+
+	char *old_brk = region_brk[r];
+
+	if ( (incr < 0) || ((old_brk + incr) > heap + (size_t)(r + 1) * MAX_HEAP) ) {
+		errno = ENOMEM;
+		fprintf(stderr, "ERROR: mem_region_sbrk failed. Ran out of memory...\n");
+		return (void *)-1;
+	}
+
+	region_brk[r] += incr;
+	sbrk_calls++;
+	sbrk_bytes += incr;
+	mem_update_peak();
 	return (void *)old_brk;
 }
 
+/*
+ * mem_map - map a separate area of `size` bytes (a multiple of the page size)
+ *		outside the heap, as mmap would. Return NULL on failure.
+ */
+void *mem_map(size_t size) {
+	int i;
+	for (i = 0; i < MEM_NMAP && maps[i].addr != NULL; i++)
+		;
+	if (i == MEM_NMAP)
+		return NULL;
+
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	maps[i].addr = p;
+	maps[i].size = size;
+	mem_mapped += size;
+	mem_update_peak();
+	return p;
+}
+
+/*
+ * mem_remap - resize an area from mem_map to `size` bytes, moving it
+ *		(without copying, as mremap) if it cannot grow in place.
+ *		Return the new address, NULL on failure (the area is kept).
+ */
+void *mem_remap(void *p, size_t size) {
+	for (int i = 0; i < MEM_NMAP; i++) {
+		if (maps[i].addr == p) {
+			void *np = mremap(p, maps[i].size, size, MREMAP_MAYMOVE);
+			if (np == MAP_FAILED)
+				return NULL;
+			mem_mapped = mem_mapped - maps[i].size + size;
+			maps[i].addr = np;
+			maps[i].size = size;
+			mem_update_peak();
+			return np;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * mem_unmap - release an area from mem_map
+ */
+void mem_unmap(void *p) {
+	for (int i = 0; i < MEM_NMAP; i++) {
+		if (maps[i].addr == p) {
+			munmap(p, maps[i].size);
+			mem_mapped -= maps[i].size;
+			maps[i].addr = NULL;
+			return;
+		}
+	}
+}
+
+/*
+ * mem_in_map - return whether bytes lo..hi lie within one mapped area
+ */
+int mem_in_map(const void *lo, const void *hi) {
+	for (int i = 0; i < MEM_NMAP; i++)
+		if (maps[i].addr != NULL && (const char *)lo >= (char *)maps[i].addr &&
+			(const char *)hi < (char *)maps[i].addr + maps[i].size)
+			return 1;
+	return 0;
+}
+
+/*
+ * mem_unmap_all - release all mapped areas
+ */
+static void mem_unmap_all(void) {
+	for (int i = 0; i < MEM_NMAP; i++) {
+		if (maps[i].addr != NULL) {
+			munmap(maps[i].addr, maps[i].size);
+			maps[i].addr = NULL;
+		}
+	}
+	mem_mapped = 0;
+}
+
+/*
+ * mem_trim - lower the brk pointer by decr bytes, and give the pages
+ *		above it back to the system. Return the new brk pointer.
+ */
+void *mem_trim(int decr) {
+	return mem_region_trim(0, decr);
+}
+
+/*
+ * mem_region_trim - mem_trim for the r-th region
+ *		The real brk is left alone, since libc malloc may sit above it.
+ */
+void *mem_region_trim(int r, int decr) {
+	char **brk = r == 0 ? &mem_brk : &region_brk[r];
+	char *lo = heap + (size_t)r * MAX_HEAP;
+	char *old_brk = *brk;
+
+	if ( (decr < 0) || (old_brk - decr < lo) ) {
+		errno = EINVAL;
+		fprintf(stderr, "ERROR: mem_trim failed. Cannot trim %d bytes...\n", decr);
+		return (void *)-1;
+	}
+
+	*brk -= decr;
+
+	/* release the whole pages above the new brk */
+	size_t pagesize = mem_pagesize();
+	char *pg = (char *)(((size_t)*brk + pagesize - 1) & ~(pagesize - 1));
+	if (old_brk > pg)
+		madvise(pg, old_brk - pg, MADV_DONTNEED);
+
+	return (void *)*brk;
+}
+
+/*
+ * mem_purge - give the pages of addresses p..p+len-1 (page aligned)
+ *		back to the system; they read as zeros when touched again
+ */
+void mem_purge(void *p, size_t len) {
+	madvise(p, len, MADV_DONTNEED);
+}
+
+/*
+ * mem_resident - returns the bytes of the heap (all regions and mapped
+ *		areas) that are resident in memory
+ */
+size_t mem_resident(void) {
+	size_t pagesize = mem_pagesize();
+	size_t pages = 0;
+
+	for (int r = 0; r < MEM_NREGION + MEM_NMAP; r++) {
+		char *lo, *hi;
+		if (r < MEM_NREGION) {
+			lo = mem_region_lo(r);
+			hi = (char *)mem_region_hi(r) + 1;
+		} else if (maps[r - MEM_NREGION].addr != NULL) {
+			lo = maps[r - MEM_NREGION].addr;
+			hi = lo + maps[r - MEM_NREGION].size;
+		} else {
+			continue;
+		}
+		if (hi <= lo)
+			continue;
+
+		size_t n = (hi - lo + pagesize - 1) / pagesize;
+		unsigned char *vec = malloc(n);
+		if (vec == NULL || mincore(lo, hi - lo, vec) < 0) {
+			free(vec);
+			continue;
+		}
+		for (size_t i = 0; i < n; i++)
+			pages += vec[i] & 1;
+		free(vec);
+	}
+	return pages * pagesize;
+}
+
+/*
+ * mem_region_lo - return address of the first byte of the r-th region
+ */
+void *mem_region_lo(int r) {
+	return (void *)(heap + (size_t)r * MAX_HEAP);
+}
+
+/*
+ * mem_region_hi - return address of the last used byte of the r-th region
+ */
+void *mem_region_hi(int r) {
+	return (void *)((r == 0 ? mem_brk : region_brk[r]) - 1);
+}
+
+/*
+ * mem_region_of - return the region holding address p
+ */
+int mem_region_of(const void *p) {
+	return (int)(((const char *)p - heap) / MAX_HEAP);
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -79,16 +310,55 @@ void *mem_heap_lo(){
 
 /* 
  * mem_heap_hi - return address of last heap byte
+ *		(in the highest region that is in use)
  */
 void *mem_heap_hi(){
+	for (int r = MEM_NREGION - 1; r > 0; r--)
+		if (region_brk[r] != heap + (size_t)r * MAX_HEAP)
+			return (void *)(region_brk[r] - 1);
 	return (void *)(mem_brk - 1);
 }
 
 /*
  * mem_heapsize() - returns the heap size in bytes
+ *		(of all regions and mapped areas)
  */
 size_t mem_heapsize() {
-	return (size_t)((void *)mem_brk - (void *)heap);
+	size_t size = (size_t)((void *)mem_brk - (void *)heap);
+	for (int r = 1; r < MEM_NREGION; r++)
+		size += (size_t)(region_brk[r] - (heap + (size_t)r * MAX_HEAP));
+	return size + mem_mapped;
+}
+
+/*
+ * mem_peak_heapsize() - returns the largest heap size in bytes since
+ *		the last reset
+ */
+size_t mem_peak_heapsize() {
+	return mem_peak;
+}
+
+/*
+ * mem_sbrk_calls() - returns the number of mem_sbrk calls since the last reset
+ */
+size_t mem_sbrk_calls() {
+	return sbrk_calls;
+}
+
+/*
+ * mem_sbrk_bytes() - returns the bytes asked by mem_sbrk since the last reset
+ */
+size_t mem_sbrk_bytes() {
+	return sbrk_bytes;
+}
+
+/*
+ * mem_update_peak - record the current heap size if it is the largest
+ */
+static void mem_update_peak(void) {
+	size_t size = mem_heapsize();
+	if (size > mem_peak)
+		mem_peak = size;
 }
 
 /*
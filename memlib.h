@@ -1,11 +1,33 @@
 #include <unistd.h>
 
+/* number of separate regions (e.g. one per arena), region 0 is the heap */
+#define MEM_NREGION 8
+/* most areas mapped outside the heap at a time */
+#define MEM_NMAP 256
+
 void mem_init(void);               
 void mem_deinit(void);
 void *mem_sbrk(int incr);
+void *mem_trim(int decr);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_peak_heapsize(void);
+size_t mem_sbrk_calls(void);
+size_t mem_sbrk_bytes(void);
 size_t mem_pagesize(void);
+void mem_purge(void *p, size_t len);
+size_t mem_resident(void);
+
+void *mem_region_sbrk(int r, int incr);
+void *mem_region_trim(int r, int decr);
+void *mem_region_lo(int r);
+void *mem_region_hi(int r);
+int mem_region_of(const void *p);
+
+void *mem_map(size_t size);
+void *mem_remap(void *p, size_t size);
+void mem_unmap(void *p);
+int mem_in_map(const void *lo, const void *hi);
 
@@ -6,7 +6,9 @@
  * 本文件即是 malloc lab 说明文档要求提交的 `mm.c`.
  * 
  * 此内存分配器采用 分离适配(segregated fit), 首次适配(first fit).
- * 优化: 对已分配块去脚部; 堆中使用偏移量替代指针; 新空闲块插入表尾.
+ * 优化: 对已分配块去脚部; 堆中使用偏移量替代指针; 新空闲块插入表尾;
+ *       realloc 尽量原地收缩/扩张 (吸收相邻空闲块);
+ *       堆尾为空闲块时只按差额扩展堆.
  * 
  * 共有13个大小类 (0~12),
  * 第i个类中的块大小属于 (16 * 2^(i-1), 16 * 2^i]
@@ -14,12 +16,81 @@
  * 每个类是一个双向循环链表,
  * 第一个块的相对序言块的偏移量(4 Bytes)都存储在序言块前的表中,
  * 若该类为空则偏移量为0. 该表由指针 `heads` 指向.
+ * 表后紧跟一个位图(4 Bytes), 第i位表示第i个类非空,
+ * 从而 find_fit 只需一次位扫描即可找到第一个可用的类.
  * 表中的每个空闲块都存储着其祖先/后继相对于自己的偏移量(4 Bytes).
  * 
+ * 若定义了 `ADDR_ORDER` (或运行时调用 mm_set_order(1)), 则各链表按地址排序,
+ * 即按地址首次适配. 插入时从表头, 表尾与该类上次插入的块(finger)中
+ * 地址最近者出发查找位置, 至多走 ORDER_WALK 步, 以免长链表使插入变为 O(n).
+ * mdriver -o 会以另一种顺序再运行一遍, 比较两者的空间利用率.
+ * 
+ * 第 TREE_CLASS 个类及以上(默认即第12个类)不用链表,
+ * 而是一棵按(大小, 地址)排序的树堆(treap), 用最佳适配查找;
+ * 左右孩子的偏移量(相对序言块)复用祖先/后继的位置.
+ * 
+ * 若定义了 `TLSF`, 则改用两级分离适配(TLSF):
+ * 第一级按2的幂划分, 每级再线性划分为16个二级类,
+ * 两级各有一个位图, 查找与插入/删除均为常数时间.
+ * 
+ * 若定义了 `SLAB`, 则不超过64字节的请求由slab页分配:
+ * 每页(2KB, 按页对齐)是堆中的一个已分配块, 页首为描述符,
+ * 其后为等大且无头部的槽. 由页对齐地址即可找到描述符,
+ * 一个位图(本身也是堆中的块)记录哪些页是slab页.
+ * 
+ * 若定义了 `THREADS`, 则为线程安全版本: 堆分为多个竞技场(arena),
+ * 每个竞技场有自己的表, 序言块, 结尾块和锁, 位于 memlib 的独立区域中;
+ * 线程按轮转(或按CPU号)选定自己的竞技场, 释放的块总是归还其所属的竞技场:
+ * 其他竞技场的块不加锁地压入其所属竞技场的无锁栈(复用后继偏移量的位置,
+ * 栈顶带ABA标签), 由下一次在该竞技场加锁分配时(或栈过长时)成批释放.
+ * 每个线程另有一个按精确大小分类的小块缓存(无需加锁),
+ * 缓存成批地从堆中补充/归还, 且每线程缓存的字节数有上限.
+ * 
+ * 未定义 `THREADS` 与 `TLSF` 时, 若堆已不小于 QUICK_HEAP, 则不超过 QUICK_MAX (256B) 的块
+ * 被释放后先不合并, 仍标记为已分配, 放入按精确大小分类的快速链表 (先进先出),
+ * 同样大小的请求直接取用; 某个表超过 QUICK_COUNT 个块, 所有表共超过 QUICK_BYTES 字节,
+ * 释放了不小于 QUICK_FLUSH 的块, 或堆需要扩展时, 才将其中的块真正释放并合并,
+ * 从而限制对空间利用率的影响.
+ * 
+ * 未定义 `SLAB` 时, 不小于 PLACE_HIGH (512B) 的请求, 若所选空闲块之上的块也不小于 PLACE_HIGH,
+ * 则从空闲块的高地址端切出, 其余从低地址端切出:
+ * 大块彼此相邻, 释放后合并成连续的空闲空间, 小块则聚在低端.
+ * 
+ * 堆尾为已分配块时, 扩展量从 CHUNKSIZE 起在持续增长中逐次翻倍 (至多 GROW_MAX),
+ * 且不超过堆大小的 1/GROW_FRAC; 一旦堆尾被释放即恢复为 CHUNKSIZE.
+ * 
+ * free 后若堆尾空闲块超过 TRIM_MAX, 则收缩堆 (memlib 的 mem_trim),
+ * 只保留 TRIM_PAD 字节, 两者之差避免反复收缩/扩展.
+ * 
+ * 不小于 PURGE_MIN (64KB) 的空闲块若在 PURGE_DECAY 次 free 内未被改动,
+ * 则每 PURGE_INTERVAL 次 free 时将其内部页面归还系统 (memlib 的 mem_purge),
+ * 并在头部/脚部置第三低位以免重复; 头部一旦被改写此标记即消失.
+ * 
+ * 不小于 HUGE_MIN (256KB) 的请求不进入堆, 而是单独映射 (memlib 的 mem_map),
+ * 释放时立即解除映射, realloc 时用 mremap 扩张而无需复制;
+ * 这种块的头部大小为0, 其前存有映射长度.
+ * 
+ * memalign / aligned_alloc / posix_memalign 在堆中查找能容纳对齐后负载的空闲块
+ * (找不到则按 大小+对齐量 分配), 将对齐前的间隙切为独立的空闲块,
+ * 多余的尾部也归还; 所得仍是普通的块, free 与 realloc 无需特殊处理.
+ * 
+ * mm_malloc_batch 从尽量少的空闲区域中连续切出多个等大的块, 每个区域只更新一次链表;
+ * mm_free_batch 将指针按地址排序 (原地), 相邻的块先合并为一块, 再一次性释放.
+ * 
+ * 区域 (mm_region_*): 对象按指针递增分配在从堆中取得的大块 (chunk) 里, 没有头部;
+ * 大块首8字节链接成表, 重置或销毁区域时逐块 free, 以大空闲块的形式回到分离链表.
+ * 
+ * 对象池 (mm_pool_*): 等大的对象没有头部, 存放在用 memalign 取得、按自身大小对齐的
+ * slab 中, 释放时由对象地址取整即得其 slab; 每个 slab 有自己的空闲对象链表,
+ * 池将有空位的 slab 与已满的 slab 分别链接. slab 变空时 free 回堆 (至多保留一个),
+ * mm_checkheap 也检查所有池的 slab.
+ * 
  * 每个块的头部中, 用第二低位存储前一个块是否已分配,
  * 从而实现已分配块不需要脚部.
  */
+#define _GNU_SOURCE /* for sched_getcpu */
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -28,6 +99,14 @@
 #include "mm.h"
 #include "memlib.h"
 
+/* `THREADS` is defined to build a thread-safe allocator (link with -pthread):
+ * there are several arenas each with its own lock, and each thread caches small blocks */
+// #define THREADS
+#ifdef THREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 /* If you want debugging output, use the following macro.  When you hand
  * in, remove the #define DEBUG line. */
 // #define DEBUG
@@ -44,6 +123,9 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define aligned_alloc mm_aligned_alloc
+#define posix_memalign mm_posix_memalign
 #endif /* def DRIVER */
 
 /* single word (4) or double word (8) alignment */
@@ -63,8 +145,119 @@
 /* Constants and macros */
 #define WSIZE 4 /* Word and header/footer size (bytes) */
 #define DSIZE 8 /* Double word size (bytes) */
-#define CHUNKSIZE (1<<12) /* Extend heap by this amount (bytes) */
+#define CHUNKSIZE (1<<12) /* Extend heap by at least this amount (bytes) */
+#define GROW_MAX (1<<18) /* largest extension of the heap (bytes) while growing */
+#define GROW_FRAC 128 /* extensions stay within 1/GROW_FRAC of the heap */
+#define TRIM_MAX (1<<20) /* free tail of the heap (bytes) that makes free trim it */
+#define TRIM_PAD (1<<18) /* free tail (bytes) kept after trimming */
+
+/* free blocks of at least PURGE_MIN bytes have their interior pages purged
+ * (undefine it to keep every page resident) */
+#define PURGE_MIN (1<<16)
+#ifdef PURGE_MIN
+#define PURGE_INTERVAL 1024 /* frees between two purging passes */
+#define PURGE_DECAY 1024 /* frees a block must stay untouched before purged */
+#define PURGED 0x4 /* header/footer bit of a purged free block */
+#endif
+
+/* `TLSF` is defined to use the two-level segregated fit engine */
+// #define TLSF
+#ifdef TLSF
+#define SL_LOG2 4 /* log2 of the number of second-level classes */
+#define SL_COUNT (1<<SL_LOG2) /* number of second-level classes */
+#define FL_SHIFT (SL_LOG2 + 3) /* blocks below 2^FL_SHIFT share first level 0 */
+#define FL_COUNT 26 /* number of first-level classes */
+#define N_SIZECLASS (FL_COUNT * SL_COUNT) /* number of the size classes */
+#define N_BITMAP (1 + FL_COUNT) /* words of bitmaps */
+#else
 #define N_SIZECLASS 13 /* number of the size classes */
+#define N_BITMAP 1 /* words of bitmaps */
+/* size classes from TREE_CLASS up share one best-fit tree instead of lists
+ * (undefine it to keep every class a list) */
+#define TREE_CLASS 12
+#endif
+
+/* `SLAB` is defined to serve small requests from header-less slab pages */
+// #define SLAB
+#ifdef SLAB
+#define SLAB_SHIFT 11 /* log2 of the slab page size */
+#define SLAB_SIZE (1<<SLAB_SHIFT) /* bytes of a slab page */
+#define SLAB_MAX 64 /* largest request served by slabs */
+#define N_SLABCLASS (SLAB_MAX / ALIGNMENT) /* number of the slab classes */
+#else
+#define N_SLABCLASS 0
+#endif
+
+/* requests of at least HUGE_MIN bytes are mapped on their own by mem_map
+ * (undefine it to keep them in the heap) */
+#define HUGE_MIN (1<<18)
+#ifdef HUGE_MIN
+/* bytes before the payload of a huge block:
+ * the mapped length (8 bytes), padding, and a header of size 0 */
+#define HUGE_HDR (2*DSIZE)
+#endif
+
+/* most bytes mm_malloc_batch carves from one free region */
+#define BATCH_BYTES (1<<20)
+
+/* regions take chunks from the heap, of REGION_CHUNK bytes at first,
+ * doubled for each new chunk up to REGION_CHUNK_MAX */
+#define REGION_CHUNK (1<<12)
+#define REGION_CHUNK_MAX (1<<16)
+
+/* pools take slabs of at least POOL_SLAB bytes (a power of 2) from the heap,
+ * large enough for POOL_MIN_OBJS objects each */
+#define POOL_SLAB (1<<12)
+#define POOL_MIN_OBJS 8
+
+/* keep each free list sorted by address (address-ordered first fit)
+ * instead of appending freed blocks to its tail;
+ * mm_set_order switches it at run time, from the next mm_init on */
+// #define ADDR_ORDER
+#define ORDER_WALK 32 /* most blocks insert_fb passes to place a block by address */
+
+/* requests of at least PLACE_HIGH bytes are carved from the high end
+ * of a free block below another large block, others from the low end
+ * (undefine it to always carve from the low end; SLAB already keeps
+ * small objects apart, and slab pages would count as large blocks) */
+#ifndef SLAB
+#define PLACE_HIGH 512
+#endif
+
+/* freed blocks of at most QUICK_MAX bytes wait in lists of exact sizes,
+ * not coalesced, to be reused first (undefine it to coalesce at once;
+ * THREADS uses the thread caches instead, and TLSF loses space to them
+ * since its rounded classes already serve small requests well) */
+#if !defined(THREADS) && !defined(TLSF)
+#define QUICK_MAX 256
+#endif
+#ifdef QUICK_MAX
+#define QUICK_NBIN (QUICK_MAX / DSIZE + 1) /* lists of exact block sizes */
+#define QUICK_COUNT 8 /* blocks in one list that make free coalesce the list */
+#define QUICK_BYTES (1<<13) /* bytes in all lists that make free coalesce them all */
+#define QUICK_FLUSH (1<<12) /* freeing a block this large coalesces all lists too */
+#define QUICK_HEAP (1<<16) /* smallest heap (bytes) to use quick lists */
+#endif
+
+#ifdef THREADS
+#ifdef SLAB
+#error "SLAB is not thread-safe yet"
+#endif
+#define TCACHE_MAX 512 /* largest block (bytes) kept in thread caches */
+/* bins of exact block sizes; a refilled block may be DSIZE larger
+ * than requested, since small remainders are not split off */
+#define TCACHE_NBIN (TCACHE_MAX / DSIZE + 2)
+#define TCACHE_COUNT 32 /* most blocks cached in one bin */
+#define TCACHE_BATCH 8 /* blocks moved per refill / flush */
+#define TCACHE_BYTES (1<<16) /* most bytes cached per thread */
+#define REMOTE_MAX 64 /* pending remote frees that make the freeing thread drain them */
+#define N_ARENA MEM_NREGION /* number of arenas, one region each */
+/* `ARENA_CPU` is defined to pick arenas by CPU id instead of round robin */
+// #define ARENA_CPU
+#endif
+
+/* words of metadata before the prologue */
+#define N_META (N_SIZECLASS + N_BITMAP + N_SLABCLASS)
 
 #define MAX(a, b) (a > b ? a : b)
 #define MIN(a, b) (a < b ? a : b)
@@ -106,28 +299,317 @@
 /* Compute the offset from fbp1 to fbp2 */
 #define OFFSET(fbp1, fbp2) ((int)((char *)(fbp2) - (char *)(fbp1)))
 
+#ifdef PURGE_MIN
+/* compute address of the word of a large free block recording when it was
+ * inserted (in frees of its arena), after PRED and SUCC */
+#define STAMP_P(fbp) ((char *)(fbp) + DSIZE)
+#endif
+
+#ifdef HUGE_MIN
+/* whether `bp` is a huge block (no heap block has size 0) */
+#define IS_HUGE(bp) (GET_SIZE(HDRP(bp)) == 0)
+/* the mapped length of huge block `bp` */
+#define HUGE_LEN(bp) (*(size_t *)((char *)(bp) - HUGE_HDR))
+#endif
+
 /* Used in segretated free list */
 /* compute address of offset of the i-th size class */
-#define HEAD_OFFP(i) ((char *)(heads) + i*WSIZE)
+#define HEAD_OFFP(i) ((char *)(ar->heads) + (i)*WSIZE)
 /* compute head ptr to the i-th size class */
-#define HEAD(i) (*(int *)(HEAD_OFFP(i)) == 0 ? NULL : (char *)(heap_listp) + *(int *)(HEAD_OFFP(i)))
+#define HEAD(i) (*(int *)(HEAD_OFFP(i)) == 0 ? NULL : (char *)(ar->heap_listp) + *(int *)(HEAD_OFFP(i)))
+/* compute address of the bitmap of non-empty size classes (after the heads) */
+#define BITMAP_P ((char *)(ar->heads) + N_SIZECLASS*WSIZE)
+#ifdef TLSF
+/* compute address of the second-level bitmap of first-level class fl */
+#define SL_BITMAP_P(fl) (BITMAP_P + (1 + (fl))*WSIZE)
+/* Test / mark the i-th size class as non-empty / empty */
+#define CLASS_SET(i) ((GET(SL_BITMAP_P((i) / SL_COUNT)) >> ((i) % SL_COUNT)) & 1)
+#define SET_CLASS(i) tlsf_set_class(i)
+#define CLEAR_CLASS(i) tlsf_clear_class(i)
+#else
+/* Test / mark the i-th size class as non-empty / empty */
+#define CLASS_SET(i) ((GET(BITMAP_P) >> (i)) & 1)
+#define SET_CLASS(i) PUT(BITMAP_P, GET(BITMAP_P) | (1u << (i)))
+#define CLEAR_CLASS(i) PUT(BITMAP_P, GET(BITMAP_P) & ~(1u << (i)))
+#endif
+
+#ifdef TREE_CLASS
+/* Used in the best-fit tree (a treap) of large free blocks */
+/* The left/right child offsets (to prologue, 0 for none) reuse pred/succ */
+#define LEFT_OFFP(fbp) PRED_OFFP(fbp)
+#define RIGHT_OFFP(fbp) SUCC_OFFP(fbp)
+/* Given a node offset (to prologue), compute the node ptr */
+#define NODE(off) ((off) == 0 ? NULL : (char *)(ar->heap_listp) + (off))
+/* Priority of a node, a hash of its address */
+#define PRIO(fbp) ((unsigned int)OFFSET(ar->heap_listp, fbp) * 2654435761u)
+/* Whether free block a sorts before b (by size, then by address) */
+#define TREE_LESS(a, b) (GET_SIZE(HDRP(a)) < GET_SIZE(HDRP(b)) || \
+    (GET_SIZE(HDRP(a)) == GET_SIZE(HDRP(b)) && (char *)(a) < (char *)(b)))
+#endif
+
+#ifdef SLAB
+/* Used in slab pages */
+/*
+ * A slab page starts at a SLAB_SIZE-aligned address and is the payload of
+ * an allocated block of (about) SLAB_SIZE bytes, so its last word may be
+ * the header of the next block. It begins with a descriptor, followed by
+ * equal-size slots without headers.
+ * Free slots form a list by the offset in their first word.
+ */
+/* Given any ptr into a slab page, compute the slab ptr sp */
+#define SLAB_OF(p) ((char *)((size_t)(p) & ~(size_t)(SLAB_SIZE-1)))
+/* Given slab ptr sp, compute address of its slot size */
+#define SLOT_SIZEP(sp) ((char *)(sp))
+/* Given slab ptr sp, compute address of its count of used slots */
+#define SLOT_USEDP(sp) ((char *)(sp) + WSIZE)
+/* Given slab ptr sp, compute address of the offset of its first free slot */
+#define SLOT_FREEP(sp) ((char *)(sp) + 2*WSIZE)
+/* Given slab ptr sp, compute address of the offset of its first unused slot */
+#define SLOT_BUMPP(sp) ((char *)(sp) + 3*WSIZE)
+/* Given slab ptr sp, compute its list node (pred/succ offsets, as in fbp) */
+#define SLAB_NODE(sp) ((char *)(sp) + 4*WSIZE)
+/* Given slab list node, compute the slab ptr sp */
+#define NODE_SLAB(np) ((char *)(np) - 4*WSIZE)
+/* Size of the slab descriptor and the end of the slots */
+#define SLAB_HDR (6*WSIZE)
+#define SLAB_END (SLAB_SIZE - WSIZE)
+/* Whether slab sp has no free slot */
+#define SLAB_FULL(sp) (GET(SLOT_FREEP(sp)) == 0 && \
+    GET(SLOT_BUMPP(sp)) + GET(SLOT_SIZEP(sp)) > SLAB_END)
+
+/* compute address of offset of the list node of the c-th slab class */
+#define SLAB_HEAD_OFFP(c) (BITMAP_P + (N_BITMAP + (c))*WSIZE)
+/* compute the list node of the first slab of the c-th slab class */
+#define SLAB_HEAD(c) (*(int *)(SLAB_HEAD_OFFP(c)) == 0 ? NULL : (char *)(ar->heap_listp) + *(int *)(SLAB_HEAD_OFFP(c)))
+#endif
+
+/* An arena is a heap of its own */
+struct arena {
+    /* ptr to prologue */
+    void *heap_listp;
+    /* ptr to header of epilogue */
+    void *epi_hdr;
+    /* ptr to heads of segretated free list */
+    void *heads;
+    /* bytes to extend the heap by next time, doubled while the heap keeps growing */
+    size_t grow;
+    /* whether the lists are sorted by address, and the last block inserted
+     * to each list (offset relative to the prologue, 0 if none),
+     * where insert_fb may start walking */
+    int addr_order;
+    unsigned int finger[N_SIZECLASS];
+#ifdef PURGE_MIN
+    /* number of frees, the clock of purging */
+    unsigned int purge_clock;
+#endif
+#ifdef QUICK_MAX
+    /* quick lists (first and last blocks) of freed blocks (still marked allocated),
+     * by exact size, linked by the first 8 bytes of their payloads */
+    void *quick[QUICK_NBIN];
+    void *quick_last[QUICK_NBIN];
+    unsigned int quick_count[QUICK_NBIN];
+    size_t quick_bytes;
+#endif
+#ifdef THREADS
+    /* lock of the arena, and counters to measure contention */
+    pthread_mutex_t lock;
+    unsigned long acquired;
+    unsigned long contended;
+    /* lock-free stack of blocks freed by threads of other arenas:
+     * an ABA tag (high 32 bits) and the offset of the top block
+     * relative to the region (low 32 bits, 0 if empty).
+     * Each block stores the offset of the next one in its SUCC word. */
+    unsigned long long remote;
+    unsigned int remote_count;
+#endif
+};
+
+/* a region: chunks taken from the heap by malloc, linked by the first
+ * 8 bytes of each (newest first), and the bump pointer in the newest one */
+struct mm_region {
+    char *chunks; /* newest chunk, NULL if none */
+    char *cur; /* next free byte in the newest chunk */
+    char *end; /* end of the newest chunk */
+    size_t chunk; /* bytes of the next chunk */
+};
+
+/* a pool of objects of one size: slabs taken from the heap by memalign,
+ * aligned to their size, so that an object finds its slab by masking */
+struct mm_pool {
+    size_t objsize; /* bytes per object, a multiple of the alignment */
+    size_t slab; /* bytes per slab (a power of 2) */
+    size_t first; /* offset of the first object in a slab */
+    unsigned int per_slab; /* objects per slab */
+    unsigned int empty; /* slabs without objects, at most one is kept */
+    struct pool_slab *partial; /* slabs with free slots */
+    struct pool_slab *full; /* slabs without */
+    size_t nslab; /* slabs held */
+    size_t inuse; /* objects allocated */
+    unsigned long allocs; /* calls of mm_pool_alloc that succeeded */
+    unsigned long frees; /* calls of mm_pool_free */
+    struct mm_pool *next; /* in the list of all pools */
+};
+
+/* the start of a slab of a pool */
+struct pool_slab {
+    struct mm_pool *pool;
+    struct pool_slab *prev, *next; /* in the partial or the full list */
+    void *free; /* freed objects, linked by their first 8 bytes */
+    unsigned int used; /* objects allocated */
+    unsigned int bump; /* objects from this index on were never allocated */
+};
 
 /* Global variables */
-/* ptr to prologue */
-static void *heap_listp = NULL;
-/* ptr to header of epilogue */
-static void *epi_hdr = NULL;
-/* ptr to heads of segretated free list */
-static void *heads = NULL;
+#ifdef THREADS
+static struct arena arenas[N_ARENA];
+/* the arena locked by this thread */
+static __thread struct arena *ar = NULL;
+#ifndef ARENA_CPU
+/* the arena this thread allocates from */
+static __thread struct arena *home = NULL;
+/* next arena to assign to a thread (round robin) */
+static unsigned int next_arena = 0;
+#endif
+#else
+static struct arena main_arena;
+#define ar (&main_arena)
+#endif
+/* whether arenas set up from now on keep their lists sorted by address */
+#ifdef ADDR_ORDER
+static int addr_order = 1;
+#else
+static int addr_order = 0;
+#endif
+#ifdef SLAB
+/* ptr to the bitmap of slab pages, and the number of pages it covers */
+static unsigned char *slab_map = NULL;
+static size_t slab_map_pages = 0;
+#endif
+/* all pools of the heap, checked by mm_checkheap */
+static struct mm_pool *pools = NULL;
+
+#ifdef THREADS
+#ifdef HUGE_MIN
+/* lock of the table of mapped areas in memlib */
+static pthread_mutex_t huge_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+/* lock of the list of pools */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+/* bumped by mm_init, so that caches of an old heap are dropped */
+static unsigned long heap_gen = 0;
+/* cache of allocated small blocks of this thread, in bins of exact size,
+ * linked by the first 8 bytes of their payloads */
+static __thread struct {
+    void *bins[TCACHE_NBIN];
+    unsigned int count[TCACHE_NBIN];
+    size_t bytes;
+    unsigned long gen;
+} tcache;
+/* used to flush the cache when a thread exits */
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+/* lock arena `a` and make it the current arena `ar` */
+#define LOCK(a) do { \
+    struct arena *a_ = (a); \
+    if (pthread_mutex_trylock(&a_->lock) != 0) { \
+        pthread_mutex_lock(&a_->lock); \
+        ++a_->contended; \
+    } \
+    ++a_->acquired; \
+    ar = a_; \
+} while (0)
+#define UNLOCK() pthread_mutex_unlock(&ar->lock)
+/* the arena owning block `bp` */
+#define ARENA_OF(bp) (&arenas[mem_region_of(bp)])
+/* set up the current arena on first use, return whether it is usable */
+#define ARENA_READY() (ar->heap_listp != NULL || arena_init() == 0)
+/* extend the region of the current arena */
+#define ARENA_SBRK(incr) mem_region_sbrk(ar - arenas, (incr))
+#define ARENA_TRIM(decr) mem_region_trim(ar - arenas, (decr))
+#else
+#define LOCK(a)
+#define UNLOCK()
+#define ARENA_READY() 1
+#define remote_drain()
+#define ARENA_SBRK(incr) mem_sbrk(incr)
+#define ARENA_TRIM(decr) mem_trim(decr)
+#endif
 
 /* Helper routines */
+static int arena_init(void);
+static void arena_check(int lineno);
 static void *extend_heap(size_t words, int palloc);
-static void place(void *bp, size_t asize);
+static size_t tail_free_size(void);
+static void trim_heap(void);
+#ifdef PURGE_MIN
+static void purge_heap(void);
+static void purge_block(void *fbp);
+#ifdef TREE_CLASS
+static void tree_purge(unsigned int root);
+#endif
+#endif
+static void *place(void *bp, size_t asize);
+static void trim_block(void *bp, size_t asize);
+static int size_class(size_t size);
+#ifdef TLSF
+static void tlsf_set_class(int i);
+static void tlsf_clear_class(int i);
+#endif
 static void *find_fit(size_t asize);
 static void *coalesce(void *bp);
 static void insert_fb(void *fbp);
+static void *order_succ(int i, void *fbp);
 static void delete_fb(void *fbp);
 static void vb_checklist(void);
+static void pool_check(int lineno);
+#ifdef TREE_CLASS
+static unsigned int tree_insert(unsigned int root, void *fbp);
+static unsigned int tree_delete(unsigned int root, void *fbp);
+static unsigned int tree_merge(unsigned int a, unsigned int b);
+static void *tree_fit(size_t asize);
+static size_t tree_check(unsigned int root, void *lo, void *hi, int lineno);
+#endif
+static void *alloc_block(size_t asize);
+static void free_block(void *bp);
+static void *resize_block(void *bp, size_t asize);
+#ifdef QUICK_MAX
+static void *quick_pop(size_t asize);
+static void quick_push(void *bp);
+static void quick_release(int b);
+static void quick_flush(void);
+#endif
+#ifdef HUGE_MIN
+static void *huge_alloc(size_t size);
+static void *huge_resize(void *bp, size_t size);
+static void huge_free(void *bp);
+#endif
+#ifdef THREADS
+static struct arena *arena_home(void);
+static void free_owned(void *bp, struct arena **held);
+static void remote_push(struct arena *a, void *bp);
+static void remote_drain(void);
+static void tcache_key_init(void);
+static void tcache_reset(void);
+static void *tcache_pop(size_t asize);
+static void tcache_push(void *bp);
+static void tcache_flush(void);
+static void tcache_exit(void *arg);
+#endif
+static char *align_payload(char *bp, size_t align);
+static void *aligned_fit(size_t asize, size_t align);
+static void *alloc_aligned(size_t asize, size_t align);
+static size_t carve_run(size_t asize, size_t n, void **out);
+static int batch_alone(void *bp);
+static void sort_ptrs(void **a, size_t n);
+#ifdef SLAB
+static int is_slab(const void *p);
+static void *slab_alloc(int c);
+static void slab_free(void *p);
+static void *slab_new(int c);
+static void slab_link(void *sp);
+static void slab_unlink(void *sp);
+#endif
 
 
 /*
@@ -137,36 +619,86 @@ static void vb_checklist(void);
 int mm_init(void) {
     vb_printf("mm_init(): called\n");
 
-    heap_listp = NULL;
-    epi_hdr = NULL;
-    heads = NULL;
+#ifdef SLAB
+    slab_map = NULL;
+    slab_map_pages = 0;
+#endif
+    pools = NULL;
+#ifdef THREADS
+    /* other arenas are set up when first used */
+    ++heap_gen;
+    for (int k=0; k<N_ARENA; ++k) {
+        arenas[k].heap_listp = NULL;
+        arenas[k].epi_hdr = NULL;
+        arenas[k].heads = NULL;
+        arenas[k].remote = 0;
+        arenas[k].remote_count = 0;
+        pthread_mutex_init(&arenas[k].lock, NULL);
+    }
+    LOCK(arena_home());
+    int ret = arena_init();
+    UNLOCK();
+    return ret;
+#else
+    return arena_init();
+#endif
+}
+
+/*
+ * arena_init - set up the heap of the current arena
+ * return -1 on error, 0 on success.
+ */
+static int arena_init(void) {
+    ar->heap_listp = NULL;
+    ar->epi_hdr = NULL;
+    ar->heads = NULL;
+    ar->grow = CHUNKSIZE;
+    ar->addr_order = addr_order;
+    memset(ar->finger, 0, sizeof(ar->finger));
+#ifdef PURGE_MIN
+    ar->purge_clock = 0;
+#endif
+#ifdef QUICK_MAX
+    memset(ar->quick, 0, sizeof(ar->quick));
+    memset(ar->quick_count, 0, sizeof(ar->quick_count));
+    ar->quick_bytes = 0;
+#endif
 
-    int padding = N_SIZECLASS%2 ? 0 : 1; /* padding for alignment */
-    heads = mem_sbrk((3 + N_SIZECLASS + padding) * WSIZE);
+    int padding = N_META%2 ? 0 : 1; /* padding for alignment */
+    void *heads = ARENA_SBRK((3 + N_META + padding) * WSIZE);
     if (heads == (void *)-1)
         return -1;
+    ar->heads = heads;
     
     for (int i=0; i<N_SIZECLASS; ++i)
         PUT(HEAD_OFFP(i), 0); /* heads of size classes */
+    for (int i=0; i<N_BITMAP; ++i)
+        PUT(BITMAP_P + i*WSIZE, 0); /* all size classes empty */
+#ifdef SLAB
+    for (int c=0; c<N_SLABCLASS; ++c)
+        PUT(SLAB_HEAD_OFFP(c), 0); /* no slab yet */
+#endif
 
-    heap_listp = heads + (N_SIZECLASS + padding) * WSIZE;
+    ar->heap_listp = heads + (N_META + padding) * WSIZE;
     if (padding)
-        PUT(heap_listp - 1 * WSIZE, 0);
-    PUT(heap_listp, PACK(DSIZE, 1, 2)); /* prologue header */
-    PUT(heap_listp + 1 * WSIZE, 0); /* prologue padding */
-    PUT(heap_listp + 2 * WSIZE, PACK(0, 1, 2)); /* epilogue header */
+        PUT(ar->heap_listp - 1 * WSIZE, 0);
+    PUT(ar->heap_listp, PACK(DSIZE, 1, 2)); /* prologue header */
+    PUT(ar->heap_listp + 1 * WSIZE, 0); /* prologue padding */
+    PUT(ar->heap_listp + 2 * WSIZE, PACK(0, 1, 2)); /* epilogue header */
 
-    heap_listp += 1 * WSIZE; /* point to prologue */
+    ar->heap_listp += 1 * WSIZE; /* point to prologue */
     
-    vb_printf("mm_init(): heads = %p, heap_listp = %p\n", heads, heap_listp);
+    vb_printf("mm_init(): heads = %p, heap_listp = %p\n", ar->heads, ar->heap_listp);
 
     void *fbp = extend_heap(CHUNKSIZE / WSIZE, 2);
-    if (fbp == NULL) /* fail */
+    if (fbp == NULL) { /* fail */
+        ar->heap_listp = NULL;
         return -1;
+    }
     /* suceed */
     insert_fb(fbp);
 
-    vb_printf("mm_init(): epi_hdr = %p\n", epi_hdr);
+    vb_printf("mm_init(): epi_hdr = %p\n", ar->epi_hdr);
 #ifdef DEBUG
     mm_checkheap(__LINE__);
 #endif
@@ -180,29 +712,58 @@ int mm_init(void) {
 void *malloc(size_t size) {
     vb_printf("malloc(%#lx): called\n", size);
 
-    if (heap_listp == NULL)
+#ifndef THREADS
+    if (ar->heap_listp == NULL)
         mem_init();
+#endif
 
     if (size == 0)
         return NULL;
     
-    size_t asize = MAX(ALIGN(size + WSIZE), 2*DSIZE); /* adjust block size */
-    void *bp = find_fit(asize);
+#ifdef SLAB
+    if (size <= SLAB_MAX) {
+        void *p = slab_alloc((size - 1) / ALIGNMENT);
+        vb_printf("malloc(%#lx): will return %p (slab)\n", size, p);
+        return p;
+    }
+#endif
 
-    if (bp != NULL) { /* found */
-        place(bp, asize);
-    } else { /* not found, extend heap */
-        size_t esize = MAX(asize, CHUNKSIZE); /* size to extend */
-        int epalloc = GET_PALLOC(epi_hdr);
-        bp = extend_heap(esize / WSIZE, epalloc);
-        if (bp == NULL) /* fail */
-            return NULL;
+#ifdef HUGE_MIN
+    if (size >= HUGE_MIN) {
+        void *p = huge_alloc(size);
+        vb_printf("malloc(%#lx): will return %p (huge)\n", size, p);
+        return p;
+    }
+#endif
 
-        insert_fb(bp);
+    size_t asize = MAX(ALIGN(size + WSIZE), 2*DSIZE); /* adjust block size */
+    void *bp;
+
+#ifdef THREADS
+    if (asize <= TCACHE_MAX) {
+        bp = tcache_pop(asize);
+        vb_printf("malloc(%#lx): will return %p (cache)\n", size, bp);
+        return bp;
+    }
+#endif
+#ifdef QUICK_MAX
+    if (asize <= QUICK_MAX && (bp = quick_pop(asize)) != NULL) {
+        vb_printf("malloc(%#lx): will return %p (quick)\n", size, bp);
+        return bp;
+    }
+#endif
 
-        place(bp, asize);
+    LOCK(arena_home());
+    if (ARENA_READY()) {
+        remote_drain();
+        bp = alloc_block(asize);
+    } else {
+        bp = NULL;
     }
-    
+    UNLOCK();
+    if (bp == NULL) /* fail */
+        return NULL;
+
     vb_printf("malloc(%#lx): will return %p\n", size, bp);
 
 #ifdef DEBUG
@@ -222,22 +783,57 @@ void free(void *ptr) {
     if(ptr == NULL)
         return;
 
-    if (heap_listp == NULL)
+#ifndef THREADS
+    if (ar->heap_listp == NULL)
         mem_init();
+#endif
 
-    size_t size = GET_SIZE(HDRP(ptr));
-    int palloc = GET_PALLOC(HDRP(ptr));
-    PUT(HDRP(ptr), PACK(size, 0, palloc));
-    PUT(FTRP(ptr), PACK(size, 0, palloc));
+#ifdef SLAB
+    if (is_slab(ptr)) {
+        slab_free(ptr);
+        return;
+    }
+#endif
 
-    /* change the palloc bit of the next block */
-    size_t nsize = GET_SIZE(HDRP(NEXT_BLKP(ptr)));
-    int nalloc = GET_ALLOC(HDRP(NEXT_BLKP(ptr)));
-    PUT(HDRP(NEXT_BLKP(ptr)), PACK(nsize, nalloc, 0));
+#ifdef HUGE_MIN
+    if (IS_HUGE(ptr)) {
+        huge_free(ptr);
+        return;
+    }
+#endif
+
+#ifdef THREADS
+    if (GET_SIZE(HDRP(ptr)) <= TCACHE_MAX) {
+        tcache_push(ptr);
+        return;
+    }
 
-    ptr = coalesce(ptr);
+    if (ARENA_OF(ptr) != arena_home()) {
+        remote_push(ARENA_OF(ptr), ptr);
+        return;
+    }
+#endif
+#ifdef QUICK_MAX
+    if (GET_SIZE(HDRP(ptr)) <= QUICK_MAX &&
+        (char *)(ar->epi_hdr) - (char *)(ar->heap_listp) >= QUICK_HEAP) {
+        quick_push(ptr);
+#ifdef DEBUG
+        mm_checkheap(__LINE__);
+#endif
+        return;
+    }
+    if (GET_SIZE(HDRP(ptr)) >= QUICK_FLUSH && ar->quick_bytes > 0)
+        quick_flush();
+#endif
 
-    insert_fb(ptr);
+    LOCK(ARENA_OF(ptr));
+    free_block(ptr);
+    trim_heap();
+#ifdef PURGE_MIN
+    if (++ar->purge_clock % PURGE_INTERVAL == 0)
+        purge_heap();
+#endif
+    UNLOCK();
 
 #ifdef DEBUG
     mm_checkheap(__LINE__);
@@ -248,11 +844,12 @@ void free(void *ptr) {
 /*
  * realloc - reallocte the memory pointed to by `oldptr`
  * 
- * It's a naive version.
- * Simply allocate a new area and copy the old memory there,
- * and then free the old pointer.
+ * Work in place whenever possible (see `resize_block`).
+ * Only when it fails, allocate a new area, copy and free the old one.
  */
 void *realloc(void *oldptr, size_t size) {
+    vb_printf("realloc(%p, %#lx): called\n", oldptr, size);
+
     if (size == 0) {
         mm_free(oldptr);
         return NULL;
@@ -261,11 +858,49 @@ void *realloc(void *oldptr, size_t size) {
     if (oldptr == NULL)
         return malloc(size);
 
-    void *newptr = malloc(size);
+#ifdef SLAB
+    if (is_slab(oldptr)) {
+        size_t slot = GET(SLOT_SIZEP(SLAB_OF(oldptr)));
+        if (size <= slot) /* still fits in the slot */
+            return oldptr;
+
+        void *newptr = malloc(size);
+        if (newptr == NULL)
+            return NULL;
+        memcpy(newptr, oldptr, slot);
+        slab_free(oldptr);
+        return newptr;
+    }
+#endif
+
+    size_t asize = MAX(ALIGN(size + WSIZE), 2*DSIZE); /* adjust block size */
+    size_t oldsize = GET_SIZE(HDRP(oldptr)) - WSIZE; /* payload size */
+    void *newptr;
+
+#ifdef HUGE_MIN
+    if (IS_HUGE(oldptr)) {
+        if (size >= HUGE_MIN) /* remap, without copying */
+            return huge_resize(oldptr, size);
+        oldsize = HUGE_LEN(oldptr) - HUGE_HDR;
+    } else if (size < HUGE_MIN)
+#endif
+    {
+        LOCK(ARENA_OF(oldptr));
+        newptr = resize_block(oldptr, asize);
+        UNLOCK();
+        if (newptr != NULL) {
+#ifdef DEBUG
+            mm_checkheap(__LINE__);
+#endif
+            return newptr;
+        }
+    }
+
+    /* fall back to move-and-copy */
+    newptr = malloc(size);
     if (newptr == NULL)
         return NULL;
 
-    size_t oldsize = GET_SIZE(HDRP(oldptr));
     memcpy(newptr, oldptr, MIN(size, oldsize));
 
     mm_free(oldptr);
@@ -287,345 +922,2284 @@ void *calloc (size_t nmemb, size_t size) {
     return newptr;
 }
 
+/*
+ * memalign - allocate `size` bytes at an address that is a multiple of
+ * `align`, return NULL if `align` is not a power of 2
+ */
+void *memalign(size_t align, size_t size) {
+    vb_printf("memalign(%#lx, %#lx): called\n", align, size);
+
+    if (align == 0 || (align & (align - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (align <= ALIGNMENT)
+        return malloc(size);
+
+#ifndef THREADS
+    if (ar->heap_listp == NULL)
+        mem_init();
+#endif
+
+    if (size == 0)
+        return NULL;
+
+    /* aligned blocks always come from the heap:
+     * slab slots and huge blocks have their own fixed alignment */
+    size_t asize = MAX(ALIGN(size + WSIZE), 2*DSIZE); /* adjust block size */
+    void *bp;
+
+    LOCK(arena_home());
+    if (ARENA_READY()) {
+        remote_drain();
+        bp = alloc_aligned(asize, align);
+    } else {
+        bp = NULL;
+    }
+    UNLOCK();
+
+    vb_printf("memalign(%#lx, %#lx): will return %p\n", align, size, bp);
+
+#ifdef DEBUG
+    mm_checkheap(__LINE__);
+#endif
+    return bp;
+}
 
 /*
- * Return whether the pointer is in the heap.
- * May be useful for debugging.
+ * aligned_alloc - C11 aligned allocation, same as memalign
  */
-static int in_heap(const void *p) {
-    return p <= mem_heap_hi() && p >= mem_heap_lo();
+void *aligned_alloc(size_t align, size_t size) {
+    return memalign(align, size);
 }
 
 /*
- * Return whether the pointer is aligned.
- * May be useful for debugging.
+ * posix_memalign - store in `*memptr` a block of `size` bytes aligned to
+ * `align` (a power of 2 multiple of sizeof(void *)),
+ * return 0 on success, EINVAL or ENOMEM on error
  */
-static int aligned(const void *p) {
-    return (size_t)ALIGN(p) == (size_t)p;
+int posix_memalign(void **memptr, size_t align, size_t size) {
+    if (align % sizeof(void *) != 0 || (align & (align - 1)) != 0)
+        return EINVAL;
+
+    void *p = memalign(align, size);
+    if (p == NULL && size != 0)
+        return ENOMEM;
+    *memptr = p;
+    return 0;
 }
 
 /*
- * mm_checkheap - check almost everything
- * 
- * Used in dubugging.
+ * mm_malloc_batch - allocate `n` blocks of `size` bytes each into `out`,
+ * carving runs of them from as few free regions as possible
+ * (one list update per region).
+ * return how many blocks were allocated (less than `n` on error)
  */
-void mm_checkheap(int lineno) {
-    /* check prologue and epilogue blocks */
-    if (!in_heap(heap_listp) || GET_ALLOC(HDRP(heap_listp)) != 1 || 
-        GET_SIZE(HDRP(heap_listp)) != DSIZE || GET_PALLOC(HDRP(heap_listp)) != 2) {
-        dbg_printf("line %d: prologue error\n", lineno);
-        exit(1);
-    }
-    if (!in_heap(epi_hdr) || GET_ALLOC(epi_hdr) != 1 || 
-        GET_SIZE(epi_hdr) != 0) {
-        dbg_printf("line %d: epilogue error\n", lineno);
-        exit(1);
+size_t mm_malloc_batch(size_t size, size_t n, void **out) {
+    vb_printf("mm_malloc_batch(%#lx, %lu): called\n", size, n);
+
+#ifndef THREADS
+    if (ar->heap_listp == NULL)
+        mem_init();
+#endif
+
+    size_t k = 0;
+    if (size == 0)
+        return 0;
+
+    /* slab slots and huge blocks come one by one */
+    int single = n < 2;
+#ifdef SLAB
+    single |= size <= SLAB_MAX;
+#endif
+#ifdef HUGE_MIN
+    single |= size >= HUGE_MIN;
+#endif
+    if (single) {
+        while (k < n && (out[k] = malloc(size)) != NULL)
+            ++k;
+        return k;
     }
 
-    /* count free blocks in 2 ways */
-    size_t cnt1 = 0, cnt2 = 0;
+    size_t asize = MAX(ALIGN(size + WSIZE), 2*DSIZE); /* adjust block size */
+#ifdef QUICK_MAX
+    if (asize <= QUICK_MAX)
+        while (k < n && (out[k] = quick_pop(asize)) != NULL)
+            ++k;
+#endif
 
-    /* check each block by address order */
-    void *ptr = heap_listp;
-    while (GET_SIZE(HDRP(ptr)) != 0) {
-        if (GET_ALLOC(HDRP(ptr)) == 0)
-            ++cnt1;
-        
-        /* check the alignment */
-        if (!aligned(ptr)) {
-            dbg_printf("line %d: block %p not aligned\n", lineno, ptr);
-            exit(1);
-        }
+    LOCK(arena_home());
+    if (ARENA_READY()) {
+        remote_drain();
+        size_t m;
+        while (k < n && (m = carve_run(asize, n - k, out + k)) > 0)
+            k += m;
+    }
+    UNLOCK();
 
-        /* check if the header and footer is consistent */
-        if (GET_ALLOC(HDRP(ptr)) == 0 && *(unsigned int *)(HDRP(ptr)) != *(unsigned int *)(FTRP(ptr))) {
-            dbg_printf("line %d: block %p head-foot inconsistent\n"
-                "\tblock %p: head: %#x foot: %#x\n", lineno, ptr, ptr, 
-                *(unsigned int *)(HDRP(ptr)), *(unsigned int *)(FTRP(ptr)));
-            exit(1);
-        }
+    vb_printf("mm_malloc_batch(%#lx, %lu): allocated %lu\n", size, n, k);
 
-        /* check if there are 2 neighboring free blocks not coalensced */
-        if (GET_ALLOC(HDRP(ptr)) == 0 && GET_ALLOC(HDRP(NEXT_BLKP(ptr))) == 0) {
-            dbg_printf("line %d: block %p & %p not coalensced\n", lineno, ptr, NEXT_BLKP(ptr));
-            exit(1);
-        }
+#ifdef DEBUG
+    mm_checkheap(__LINE__);
+#endif
+    return k;
+}
 
-        /* check if the alloc-bit and the palloc-bit of the next block is consistent */
-        if (!GET_ALLOC(HDRP(ptr)) != !GET_PALLOC(HDRP(NEXT_BLKP(ptr)))) {
-            dbg_printf("line %d: block %p & %p header inconsistent\n", lineno, ptr, NEXT_BLKP(ptr));
-            exit(1);
-        }
+/*
+ * mm_free_batch - free the `n` blocks in `ptrs` (NULL entries are skipped)
+ * 
+ * The array is reordered: it is sorted by address in place,
+ * so that each run of adjacent blocks is merged and then freed
+ * (coalesced and inserted) once.
+ */
+void mm_free_batch(void **ptrs, size_t n) {
+    vb_printf("mm_free_batch(%p, %lu): called\n", ptrs, n);
 
-        ptr = NEXT_BLKP(ptr);
+    /* keep the blocks that can be merged at the front, free the others */
+    size_t m = 0;
+    for (size_t k = 0; k < n; ++k) {
+        if (ptrs[k] == NULL)
+            continue;
+        if (batch_alone(ptrs[k]))
+            free(ptrs[k]);
+        else
+            ptrs[m++] = ptrs[k];
     }
+    if (m == 0)
+        return;
 
-    /* check each free block in each list */
-    for (int i=0; i<N_SIZECLASS; ++i) {
-        void *head = HEAD(i);
-        if (head != NULL) {
-            // vb_printf("\tcheck(%d): head = %p\n", lineno, head);
-
-            ptr = head;
-            ++cnt2;
+    sort_ptrs(ptrs, m);
 
-            /* check if this ptr is in heap */
-            if (!in_heap(ptr)) {
-                dbg_printf("line %d: fb %p not in heap\n", lineno, ptr);
-                exit(1);
-            }
+    LOCK(arena_home());
+    for (size_t k = 0; k < m; ) {
+        char *bp = ptrs[k];
+        size_t size = GET_SIZE(HDRP(bp));
 
-            /* check the consistency of succ-prev pairs */
-            if (SUCC(PRED(ptr)) != ptr) {
-                dbg_printf("line %d: fb %p not matching its pred\n", lineno, ptr);
-                exit(1);
-            }
-            if (PRED(SUCC(ptr)) != ptr) {
-                dbg_printf("line %d: fb %p not matching its succ\n", lineno, ptr);
-                exit(1);
-            }
+        /* merge the run of blocks right after it into one block */
+        while (++k < m && (char *)ptrs[k] == bp + size)
+            size += GET_SIZE(HDRP(ptrs[k]));
+        PUT(HDRP(bp), PACK(size, 1, GET_PALLOC(HDRP(bp))));
+
+        free_block(bp);
+    }
+    trim_heap();
+#ifdef PURGE_MIN
+    unsigned int clock = ar->purge_clock;
+    ar->purge_clock += m;
+    if (ar->purge_clock / PURGE_INTERVAL != clock / PURGE_INTERVAL)
+        purge_heap();
+#endif
+    UNLOCK();
+
+#ifdef DEBUG
+    mm_checkheap(__LINE__);
+#endif
+    vb_printf("\n");
+}
+
+/*
+ * mm_region_create - create an empty region
+ * return NULL on error
+ */
+struct mm_region *mm_region_create(void) {
+    struct mm_region *r = malloc(sizeof(struct mm_region));
+    if (r == NULL)
+        return NULL;
+    r->chunks = NULL;
+    r->cur = NULL;
+    r->end = NULL;
+    r->chunk = REGION_CHUNK;
+    return r;
+}
+
+/*
+ * mm_region_alloc - allocate `size` bytes in region `r`, without a header:
+ * bump the pointer in the newest chunk, or take a new chunk from the heap.
+ * An object larger than a quarter of a chunk gets a chunk of its own,
+ * linked behind the newest one, so that the bump chunk is not given up.
+ * return NULL on error (or if `size` is 0 or absurdly large)
+ */
+void *mm_region_alloc(struct mm_region *r, size_t size) {
+    if (size == 0 || size > ((size_t)-1 >> 1))
+        return NULL;
+    size = ALIGN(size);
+
+    if (size > (size_t)(r->end - r->cur)) {
+        char *c;
+        if (size + DSIZE > r->chunk / 4 && r->chunks != NULL) {
+            /* a chunk of its own */
+            if ((c = malloc(size + DSIZE)) == NULL)
+                return NULL;
+            *(char **)c = *(char **)(r->chunks);
+            *(char **)(r->chunks) = c;
+            return c + DSIZE;
+        }
+
+        size_t csize = MAX(r->chunk, size + DSIZE);
+        if ((c = malloc(csize)) == NULL)
+            return NULL;
+        *(char **)c = r->chunks;
+        r->chunks = c;
+        r->cur = c + DSIZE;
+        r->end = c + csize;
+        r->chunk = MIN(2 * r->chunk, REGION_CHUNK_MAX);
+    }
+
+    void *p = r->cur;
+    r->cur += size;
+    return p;
+}
+
+/*
+ * mm_region_reset - release every object of region `r` at once:
+ * all chunks but the newest go back to the heap (as large free blocks),
+ * and the newest one is reused from its start.
+ */
+void mm_region_reset(struct mm_region *r) {
+    if (r->chunks == NULL)
+        return;
+
+    char *c = *(char **)(r->chunks);
+    while (c != NULL) {
+        char *next = *(char **)c;
+        free(c);
+        c = next;
+    }
+    *(char **)(r->chunks) = NULL;
+    r->cur = r->chunks + DSIZE;
+}
+
+/*
+ * mm_region_destroy - release region `r` and all its objects
+ */
+void mm_region_destroy(struct mm_region *r) {
+    if (r == NULL)
+        return;
+
+    char *c = r->chunks;
+    while (c != NULL) {
+        char *next = *(char **)c;
+        free(c);
+        c = next;
+    }
+    free(r);
+}
+
+/*
+ * mm_pool_create - create a pool of objects of `objsize` bytes,
+ * aligned to `align` (a power of 2, 0 for the default alignment)
+ * return NULL on error
+ */
+struct mm_pool *mm_pool_create(size_t objsize, size_t align) {
+    if (align == 0)
+        align = ALIGNMENT;
+    if ((align & (align - 1)) != 0 || objsize == 0 || objsize > POOL_SLAB * 64)
+        return NULL;
+    align = MAX(align, sizeof(void *));
+
+    struct mm_pool *p = malloc(sizeof(struct mm_pool));
+    if (p == NULL)
+        return NULL;
+    p->objsize = (objsize + align - 1) & ~(align - 1);
+    p->first = (sizeof(struct pool_slab) + align - 1) & ~(align - 1);
+    /* the last word of a slab is the header of the next block */
+    p->slab = POOL_SLAB;
+    while (p->first + POOL_MIN_OBJS * p->objsize > p->slab - WSIZE)
+        p->slab <<= 1;
+    p->per_slab = (p->slab - WSIZE - p->first) / p->objsize;
+    p->empty = 0;
+    p->partial = NULL;
+    p->full = NULL;
+    p->nslab = 0;
+    p->inuse = 0;
+    p->allocs = 0;
+    p->frees = 0;
+
+#ifdef THREADS
+    pthread_mutex_lock(&pool_lock);
+#endif
+    p->next = pools;
+    pools = p;
+#ifdef THREADS
+    pthread_mutex_unlock(&pool_lock);
+#endif
+    return p;
+}
+
+/*
+ * mm_pool_alloc - allocate an object of pool `p`, without a header:
+ * a freed slot of the first slab with free slots, or its next untouched one;
+ * take a new slab from the heap if there is none.
+ * return NULL on error
+ */
+void *mm_pool_alloc(struct mm_pool *p) {
+    struct pool_slab *s = p->partial;
+    if (s == NULL) {
+        if ((s = memalign(p->slab, p->slab - WSIZE)) == NULL)
+            return NULL;
+        s->pool = p;
+        s->prev = NULL;
+        s->next = NULL;
+        s->free = NULL;
+        s->used = 0;
+        s->bump = 0;
+        p->partial = s;
+        ++p->nslab;
+        ++p->empty;
+    }
+
+    void *obj;
+    if (s->free != NULL) {
+        obj = s->free;
+        s->free = *(void **)obj;
+    } else {
+        obj = (char *)s + p->first + (size_t)s->bump++ * p->objsize;
+    }
+    if (s->used++ == 0)
+        --p->empty;
+    if (s->used == p->per_slab) { /* move it to the full list */
+        p->partial = s->next;
+        if (s->next != NULL)
+            s->next->prev = NULL;
+        s->next = p->full;
+        if (p->full != NULL)
+            p->full->prev = s;
+        p->full = s;
+    }
+    ++p->inuse;
+    ++p->allocs;
+    return obj;
+}
+
+/*
+ * mm_pool_free - free object `obj` of pool `p`.
+ * A slab left without objects goes back to the heap,
+ * unless it is the only empty slab of the pool.
+ */
+void mm_pool_free(struct mm_pool *p, void *obj) {
+    if (obj == NULL)
+        return;
+
+    struct pool_slab *s = (struct pool_slab *)((size_t)obj & ~(p->slab - 1));
+    *(void **)obj = s->free;
+    s->free = obj;
+    --p->inuse;
+    ++p->frees;
+
+    if (s->used-- == p->per_slab) { /* move it to the partial list */
+        if (s->prev != NULL)
+            s->prev->next = s->next;
+        else
+            p->full = s->next;
+        if (s->next != NULL)
+            s->next->prev = s->prev;
+        s->prev = NULL;
+        s->next = p->partial;
+        if (p->partial != NULL)
+            p->partial->prev = s;
+        p->partial = s;
+    }
+
+    if (s->used == 0) {
+        if (p->empty == 0) { /* keep it, so that a pool at the edge won't thrash */
+            ++p->empty;
+            return;
+        }
+        if (s->prev != NULL)
+            s->prev->next = s->next;
+        else
+            p->partial = s->next;
+        if (s->next != NULL)
+            s->next->prev = s->prev;
+        --p->nslab;
+        free(s);
+    }
+}
+
+/*
+ * mm_pool_stats - report the usage of pool `p`
+ */
+void mm_pool_stats(const struct mm_pool *p, struct mm_pool_stats *st) {
+    st->objsize = p->objsize;
+    st->slabs = p->nslab;
+    st->bytes = p->nslab * p->slab;
+    st->inuse = p->inuse;
+    st->capacity = p->nslab * p->per_slab;
+    st->allocs = p->allocs;
+    st->frees = p->frees;
+}
+
+/*
+ * mm_pool_destroy - release pool `p` and all its objects
+ */
+void mm_pool_destroy(struct mm_pool *p) {
+    if (p == NULL)
+        return;
+
+#ifdef THREADS
+    pthread_mutex_lock(&pool_lock);
+#endif
+    struct mm_pool **pp = &pools;
+    while (*pp != p)
+        pp = &(*pp)->next;
+    *pp = p->next;
+#ifdef THREADS
+    pthread_mutex_unlock(&pool_lock);
+#endif
+
+    struct pool_slab *lists[2] = {p->partial, p->full};
+    for (int k=0; k<2; ++k) {
+        struct pool_slab *s = lists[k];
+        while (s != NULL) {
+            struct pool_slab *next = s->next;
+            free(s);
+            s = next;
+        }
+    }
+    free(p);
+}
+
+
+/*
+ * mm_lock_stats - report how many times the arena locks were taken,
+ * and how many of them had to wait for another thread.
+ * Both are 0 unless built with `THREADS`.
+ */
+void mm_lock_stats(unsigned long *acquired, unsigned long *contended) {
+#ifdef THREADS
+    *acquired = 0;
+    *contended = 0;
+    for (int k=0; k<N_ARENA; ++k) {
+        *acquired += arenas[k].acquired;
+        *contended += arenas[k].contended;
+    }
+#else
+    *acquired = 0;
+    *contended = 0;
+#endif
+}
+
+/*
+ * mm_set_order - choose how freed blocks enter the free lists
+ * of the heaps set up by later calls to mm_init:
+ * nonzero keeps each list sorted by address, 0 appends to its tail.
+ * return the previous setting.
+ */
+int mm_set_order(int addr) {
+    int old = addr_order;
+    addr_order = addr != 0;
+    return old;
+}
+
+/*
+ * Return whether the pointer is in the heap.
+ * May be useful for debugging.
+ */
+static int in_heap(const void *p) {
+#ifdef THREADS
+    int r = mem_region_of(p);
+    return r >= 0 && r < N_ARENA && p <= mem_region_hi(r) && p >= mem_region_lo(r);
+#else
+    return p <= mem_heap_hi() && p >= mem_heap_lo();
+#endif
+}
+
+/*
+ * Return whether the pointer is aligned.
+ * May be useful for debugging.
+ */
+static int aligned(const void *p) {
+    return (size_t)ALIGN(p) == (size_t)p;
+}
+
+/*
+ * mm_checkheap - check almost everything
+ * 
+ * Used in dubugging.
+ */
+void mm_checkheap(int lineno) {
+#ifdef THREADS
+    struct arena *saved = ar;
+    for (int k=0; k<N_ARENA; ++k) {
+        if (arenas[k].heap_listp != NULL) {
+            ar = &arenas[k];
+            arena_check(lineno);
+        }
+    }
+    ar = saved;
+
+    /* check the cache of this thread */
+    if (tcache.gen == heap_gen) {
+        for (int b=0; b<TCACHE_NBIN; ++b) {
+            unsigned int n = 0;
+            for (void *ptr = tcache.bins[b]; ptr != NULL; ptr = *(void **)ptr) {
+                if (!in_heap(ptr) || !GET_ALLOC(HDRP(ptr)) ||
+                    GET_SIZE(HDRP(ptr)) != (unsigned int)b * DSIZE) {
+                    dbg_printf("line %d: cached block %p invalid\n", lineno, ptr);
+                    exit(1);
+                }
+                ++n;
+            }
+            if (n != tcache.count[b]) {
+                dbg_printf("line %d: cache bin %d count inconsistent\n", lineno, b);
+                exit(1);
+            }
+        }
+    }
+#else
+    arena_check(lineno);
+#endif
+    pool_check(lineno);
+}
+
+/*
+ * arena_check - check the heap of the current arena
+ */
+static void arena_check(int lineno) {
+    /* check prologue and epilogue blocks */
+    if (!in_heap(ar->heap_listp) || GET_ALLOC(HDRP(ar->heap_listp)) != 1 || 
+        GET_SIZE(HDRP(ar->heap_listp)) != DSIZE || GET_PALLOC(HDRP(ar->heap_listp)) != 2) {
+        dbg_printf("line %d: prologue error\n", lineno);
+        exit(1);
+    }
+    if (!in_heap(ar->epi_hdr) || GET_ALLOC(ar->epi_hdr) != 1 || 
+        GET_SIZE(ar->epi_hdr) != 0) {
+        dbg_printf("line %d: epilogue error\n", lineno);
+        exit(1);
+    }
+
+    /* count free blocks in 2 ways */
+    size_t cnt1 = 0, cnt2 = 0;
+
+    /* check each block by address order */
+    void *ptr = ar->heap_listp;
+    while (GET_SIZE(HDRP(ptr)) != 0) {
+        if (GET_ALLOC(HDRP(ptr)) == 0)
+            ++cnt1;
+        
+        /* check the alignment */
+        if (!aligned(ptr)) {
+            dbg_printf("line %d: block %p not aligned\n", lineno, ptr);
+            exit(1);
+        }
+
+        /* check if the header and footer is consistent */
+        if (GET_ALLOC(HDRP(ptr)) == 0 && *(unsigned int *)(HDRP(ptr)) != *(unsigned int *)(FTRP(ptr))) {
+            dbg_printf("line %d: block %p head-foot inconsistent\n"
+                "\tblock %p: head: %#x foot: %#x\n", lineno, ptr, ptr, 
+                *(unsigned int *)(HDRP(ptr)), *(unsigned int *)(FTRP(ptr)));
+            exit(1);
+        }
+
+        /* check if there are 2 neighboring free blocks not coalensced */
+        if (GET_ALLOC(HDRP(ptr)) == 0 && GET_ALLOC(HDRP(NEXT_BLKP(ptr))) == 0) {
+            dbg_printf("line %d: block %p & %p not coalensced\n", lineno, ptr, NEXT_BLKP(ptr));
+            exit(1);
+        }
+
+        /* check if the alloc-bit and the palloc-bit of the next block is consistent */
+        if (!GET_ALLOC(HDRP(ptr)) != !GET_PALLOC(HDRP(NEXT_BLKP(ptr)))) {
+            dbg_printf("line %d: block %p & %p header inconsistent\n", lineno, ptr, NEXT_BLKP(ptr));
+            exit(1);
+        }
+
+        ptr = NEXT_BLKP(ptr);
+    }
+
+    /* check each free block in each list */
+    for (int i=0; i<N_SIZECLASS; ++i) {
+        void *head = HEAD(i);
+
+        /* check if the bitmap agrees with the list */
+        if (!CLASS_SET(i) != (head == NULL)) {
+            dbg_printf("line %d: bitmap bit %d inconsistent\n", lineno, i);
+            exit(1);
+        }
+#ifdef TREE_CLASS
+        if (i >= TREE_CLASS) {
+            cnt2 += tree_check(GET(HEAD_OFFP(i)), NULL, NULL, lineno);
+            continue;
+        }
+#endif
+        /* the finger (if any) must be a block in this list */
+        void *finger = ar->finger[i] ? (char *)(ar->heap_listp) + ar->finger[i] : NULL;
+        if (head != NULL) {
+            // vb_printf("\tcheck(%d): head = %p\n", lineno, head);
+
+            ptr = head;
+            ++cnt2;
+            if (ptr == finger)
+                finger = NULL;
+
+            /* check if this ptr is in heap */
+            if (!in_heap(ptr)) {
+                dbg_printf("line %d: fb %p not in heap\n", lineno, ptr);
+                exit(1);
+            }
+
+            /* check the consistency of succ-prev pairs */
+            if (SUCC(PRED(ptr)) != ptr) {
+                dbg_printf("line %d: fb %p not matching its pred\n", lineno, ptr);
+                exit(1);
+            }
+            if (PRED(SUCC(ptr)) != ptr) {
+                dbg_printf("line %d: fb %p not matching its succ\n", lineno, ptr);
+                exit(1);
+            }
 
             ptr = SUCC(ptr);
             while (ptr != head) {
                 ++cnt2;
+                if (ptr == finger)
+                    finger = NULL;
+
+                /* check if this ptr is in heap */
+                if (!in_heap(ptr)) {
+                    dbg_printf("line %d: fb %p not in heap\n", lineno, ptr);
+                    exit(1);
+                }
+                
+                /* check the consistency of succ-prev pairs */
+                if (SUCC(PRED(ptr)) != ptr) {
+                    dbg_printf("line %d: fb %p not matching its pred\n", lineno, ptr);
+                    exit(1);
+                }
+                if (PRED(SUCC(ptr)) != ptr) {
+                    dbg_printf("line %d: fb %p not matching its succ\n", lineno, ptr);
+                    exit(1);
+                }
+
+                ptr = SUCC(ptr);
+            }
+        }
+        if (finger != NULL) {
+            dbg_printf("line %d: finger %p not in list %d\n", lineno, finger, i);
+            exit(1);
+        }
+    }
+
+#ifdef SLAB
+    /* check each slab with free slots in each slab class */
+    for (int c=0; c<N_SLABCLASS; ++c) {
+        void *head = SLAB_HEAD(c);
+        if (head == NULL)
+            continue;
+
+        ptr = head;
+        do {
+            char *sp = NODE_SLAB(ptr);
+
+            if (!is_slab(sp) || GET(SLOT_SIZEP(sp)) != (unsigned int)(c+1) * ALIGNMENT) {
+                dbg_printf("line %d: slab %p not registered\n", lineno, sp);
+                exit(1);
+            }
+            /* the block may keep a tail too small to split */
+            if (GET_SIZE(HDRP(sp)) < SLAB_SIZE || !GET_ALLOC(HDRP(sp))) {
+                dbg_printf("line %d: slab %p block error\n", lineno, sp);
+                exit(1);
+            }
+            if (SLAB_FULL(sp)) {
+                dbg_printf("line %d: full slab %p in list\n", lineno, sp);
+                exit(1);
+            }
+
+            /* check if used + free slots make up all touched slots */
+            size_t nfree = 0;
+            unsigned int off = GET(SLOT_FREEP(sp));
+            while (off) {
+                if (off < SLAB_HDR || off >= GET(SLOT_BUMPP(sp))) {
+                    dbg_printf("line %d: slab %p free slot out of range\n", lineno, sp);
+                    exit(1);
+                }
+                ++nfree;
+                off = GET(sp + off);
+            }
+            if (nfree + GET(SLOT_USEDP(sp)) != (GET(SLOT_BUMPP(sp)) - SLAB_HDR) / GET(SLOT_SIZEP(sp))) {
+                dbg_printf("line %d: slab %p slot counts inconsistent\n", lineno, sp);
+                exit(1);
+            }
+
+            if (SUCC(PRED(ptr)) != ptr || PRED(SUCC(ptr)) != ptr) {
+                dbg_printf("line %d: slab %p list inconsistent\n", lineno, sp);
+                exit(1);
+            }
+            ptr = SUCC(ptr);
+        } while (ptr != head);
+    }
+#endif
+
+#ifdef THREADS
+    /* check the blocks waiting in the remote stack */
+    unsigned int top = (unsigned int)__atomic_load_n(&ar->remote, __ATOMIC_ACQUIRE);
+    for (ptr = top ? (char *)mem_region_lo(ar - arenas) + top : NULL; ptr != NULL;
+         ptr = *(int *)(SUCC_OFFP(ptr)) ? SUCC(ptr) : NULL) {
+        if (!in_heap(ptr) || ARENA_OF(ptr) != ar || !GET_ALLOC(HDRP(ptr))) {
+            dbg_printf("line %d: remote block %p invalid\n", lineno, ptr);
+            exit(1);
+        }
+    }
+#endif
+
+#ifdef QUICK_MAX
+    /* check the blocks waiting in quick lists */
+    size_t qbytes = 0;
+    for (int b=0; b<QUICK_NBIN; ++b) {
+        unsigned int n = 0;
+        for (ptr = ar->quick[b]; ptr != NULL; ptr = *(void **)ptr) {
+            if (!in_heap(ptr) || !aligned(ptr) || !GET_ALLOC(HDRP(ptr)) ||
+                GET_SIZE(HDRP(ptr)) != (unsigned int)b * DSIZE) {
+                dbg_printf("line %d: quick block %p invalid\n", lineno, ptr);
+                exit(1);
+            }
+            ++n;
+            qbytes += GET_SIZE(HDRP(ptr));
+        }
+        if (n != ar->quick_count[b]) {
+            dbg_printf("line %d: quick list %d count inconsistent\n", lineno, b);
+            exit(1);
+        }
+    }
+    if (qbytes != ar->quick_bytes) {
+        dbg_printf("line %d: quick bytes inconsistent\n", lineno);
+        exit(1);
+    }
+#endif
+
+#ifdef TLSF
+    /* check if the first-level bitmap agrees with the second-level ones */
+    for (int fl=0; fl<FL_COUNT; ++fl) {
+        if (!((GET(BITMAP_P) >> fl) & 1) != !GET(SL_BITMAP_P(fl))) {
+            dbg_printf("line %d: first-level bitmap bit %d inconsistent\n", lineno, fl);
+            exit(1);
+        }
+    }
+#endif
+
+    /* check cnt1-cnt2 consistency */
+    if (cnt1 != cnt2) {
+        dbg_printf("line %d: counts of fbs differ (%lu : %lu)\n", lineno, cnt1, cnt2);
+        exit(1);
+    }
+
+}
+
+/**
+ * pool_check - check the slabs of all pools: each is an allocated block
+ * of the heap owned by its pool, on the list matching its count,
+ * and its free slots are distinct objects it has handed out.
+*/
+static void pool_check(int lineno) {
+    for (struct mm_pool *p = pools; p != NULL; p = p->next) {
+        size_t nslab = 0, inuse = 0;
+        unsigned int empty = 0;
+        for (int k=0; k<2; ++k) {
+            struct pool_slab *prev = NULL;
+            for (struct pool_slab *s = k ? p->full : p->partial; s != NULL; s = s->next) {
+                if (!in_heap(s) || ((size_t)s & (p->slab - 1)) != 0 ||
+                    !GET_ALLOC(HDRP(s)) || GET_SIZE(HDRP(s)) != p->slab ||
+                    s->pool != p || s->prev != prev) {
+                    dbg_printf("line %d: slab %p of pool %p invalid\n", lineno, s, p);
+                    exit(1);
+                }
+                if (s->used > s->bump || s->bump > p->per_slab ||
+                    (k == 1) != (s->used == p->per_slab)) {
+                    dbg_printf("line %d: slab %p count inconsistent\n", lineno, s);
+                    exit(1);
+                }
+
+                /* free slots: within the untouched part, at object boundaries */
+                unsigned int nfree = 0;
+                for (char *obj = s->free; obj != NULL; obj = *(char **)obj) {
+                    size_t off = obj - ((char *)s + p->first);
+                    if (obj < (char *)s + p->first || off % p->objsize != 0 ||
+                        off / p->objsize >= s->bump || ++nfree > s->bump) {
+                        dbg_printf("line %d: free slot %p of slab %p invalid\n", lineno, obj, s);
+                        exit(1);
+                    }
+                }
+                if (nfree != s->bump - s->used) {
+                    dbg_printf("line %d: slab %p lost free slots\n", lineno, s);
+                    exit(1);
+                }
+
+                ++nslab;
+                inuse += s->used;
+                empty += s->used == 0;
+                prev = s;
+            }
+        }
+        if (nslab != p->nslab || inuse != p->inuse || empty != p->empty || empty > 1) {
+            dbg_printf("line %d: pool %p counts inconsistent\n", lineno, p);
+            exit(1);
+        }
+    }
+}
+
+
+
+/**
+ * Helper routines
+*/
+
+/**
+ * extend_heap - extend the heap by `words` bytes.
+ * Return the block ptr extended. (May coalesced)
+ * 
+ * NOT add the extended block to list yet.
+*/
+static void *extend_heap(size_t words, int palloc) {
+    size_t size = (words%2 ? words+1 : words) * WSIZE;
+
+    void *bp = ARENA_SBRK(size);
+    if (bp == (void *)-1)
+        return NULL;
+
+    PUT(HDRP(bp), PACK(size, 0, palloc));
+    PUT(FTRP(bp), PACK(size, 0, palloc));
+    ar->epi_hdr = HDRP(NEXT_BLKP(bp));
+    PUT(ar->epi_hdr, PACK(0, 1, 0)); /* new epilogue header */
+
+    vb_printf("\textend_heap(%#lx): epi_hdr = %p\n", words, ar->epi_hdr);
+
+    return coalesce(bp);
+}
+
+/**
+ * alloc_block - allocate a block of `asize` bytes (adjusted)
+ * from the segregated free list, extending the heap if needed.
+ * Return NULL on failure.
+*/
+static void *alloc_block(size_t asize) {
+    void *bp;
+    size_t tsize;
+
+    bp = find_fit(asize);
+#ifdef QUICK_MAX
+    if (bp == NULL && ar->quick_bytes > 0) {
+        /* coalesce the blocks in quick lists before extending the heap */
+        quick_flush();
+        bp = find_fit(asize);
+    }
+#endif
+
+    if (bp != NULL) { /* found */
+        bp = place(bp, asize);
+    } else if ((tsize = tail_free_size()) >= asize) {
+        /* the tail block fits, but the good-fit search of TLSF skipped it */
+        bp = (char *)(ar->epi_hdr) - tsize + WSIZE;
+        bp = place(bp, asize);
+    } else { /* not found, extend heap */
+        /* size to extend: only the shortfall if the tail block is free,
+         * otherwise the growth size (limited by the heap size) */
+        size_t esize;
+        if (tsize) {
+            esize = asize - tsize;
+        } else {
+            size_t hsize = (char *)(ar->epi_hdr) - (char *)(ar->heap_listp);
+            esize = MAX(asize, ALIGN(MIN(ar->grow, MAX(hsize / GROW_FRAC, CHUNKSIZE))));
+            ar->grow = MIN(2 * ar->grow, GROW_MAX);
+        }
+        int epalloc = GET_PALLOC(ar->epi_hdr);
+        bp = extend_heap(esize / WSIZE, epalloc);
+        if (bp == NULL) /* fail */
+            return NULL;
+
+        insert_fb(bp);
+
+        bp = place(bp, asize);
+    }
+
+    return bp;
+}
+
+/**
+ * free_block - free an allocated block and coalesce it
+ * 
+ * WILL update the free block lists
+*/
+static void free_block(void *bp) {
+    size_t size = GET_SIZE(HDRP(bp));
+    int palloc = GET_PALLOC(HDRP(bp));
+    PUT(HDRP(bp), PACK(size, 0, palloc));
+    PUT(FTRP(bp), PACK(size, 0, palloc));
+
+    /* change the palloc bit of the next block */
+    size_t nsize = GET_SIZE(HDRP(NEXT_BLKP(bp)));
+    int nalloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(nsize, nalloc, 0));
+
+    bp = coalesce(bp);
+
+    /* the heap stops growing once its tail is free */
+    if (HDRP(NEXT_BLKP(bp)) == ar->epi_hdr)
+        ar->grow = CHUNKSIZE;
+
+    insert_fb(bp);
+}
+
+/**
+ * resize_block - resize an allocated block to `asize` bytes (adjusted) in place
+ * 
+ * Shrink by splitting off the tail, grow by absorbing a free next block,
+ * or (with a memmove) a free prev block,
+ * or extend the heap if it is the last block.
+ * Return the new block ptr, NULL if it cannot be done in place.
+*/
+static void *resize_block(void *oldptr, size_t asize) {
+    size_t oldsize = GET_SIZE(HDRP(oldptr));
+    int palloc = GET_PALLOC(HDRP(oldptr));
+
+    if (asize <= oldsize) { /* shrink in place */
+        trim_block(oldptr, asize);
+        return oldptr;
+    }
+
+    void *next = NEXT_BLKP(oldptr);
+    size_t nsize = GET_ALLOC(HDRP(next)) ? 0 : GET_SIZE(HDRP(next));
+
+    if (oldsize + nsize >= asize) { /* grow into next block */
+        vb_printf("\trealloc(%p): will absorb next %p\n", oldptr, next);
+
+        delete_fb(next);
+        PUT(HDRP(oldptr), PACK(oldsize + nsize, 1, palloc));
+        trim_block(oldptr, asize);
+        return oldptr;
+    }
+
+    if (!palloc) { /* try to grow into prev (and next) block */
+        void *prev = PREV_BLKP(oldptr);
+        size_t psize = GET_SIZE(HDRP(prev));
+
+        if (psize + oldsize + nsize >= asize) {
+            vb_printf("\trealloc(%p): will absorb prev %p\n", oldptr, prev);
+
+            int ppalloc = GET_PALLOC(HDRP(prev));
+            delete_fb(prev);
+            if (nsize)
+                delete_fb(next);
+            memmove(prev, oldptr, oldsize - WSIZE);
+            PUT(HDRP(prev), PACK(psize + oldsize + nsize, 1, ppalloc));
+            trim_block(prev, asize);
+            return prev;
+        }
+    }
+
+    if (HDRP(NEXT_BLKP(nsize ? next : oldptr)) == ar->epi_hdr) {
+        /* last block in the heap, extend heap by the shortfall */
+        vb_printf("\trealloc(%p): will extend heap\n", oldptr);
+
+        void *bp = extend_heap((asize - oldsize - nsize) / WSIZE, GET_PALLOC(ar->epi_hdr));
+        if (bp == NULL) /* fail */
+            return NULL;
+
+        /* `bp` is now the free block right after `oldptr` (not in list) */
+        PUT(HDRP(oldptr), PACK(oldsize + GET_SIZE(HDRP(bp)), 1, palloc));
+        trim_block(oldptr, asize);
+        return oldptr;
+    }
+
+    return NULL;
+}
+
+#ifdef HUGE_MIN
+/**
+ * huge_alloc - map a huge block of `size` bytes of payload
+ * Return NULL on failure.
+*/
+static void *huge_alloc(size_t size) {
+    size_t len = (size + HUGE_HDR + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+
+#ifdef THREADS
+    pthread_mutex_lock(&huge_lock);
+#endif
+    char *m = mem_map(len);
+#ifdef THREADS
+    pthread_mutex_unlock(&huge_lock);
+#endif
+    if (m == NULL)
+        return NULL;
+
+    void *bp = m + HUGE_HDR;
+    HUGE_LEN(bp) = len;
+    PUT(HDRP(bp), PACK(0, 1, 0));
+    return bp;
+}
+
+/**
+ * huge_resize - remap a huge block to `size` bytes of payload
+ * (still huge), the payload is moved by the kernel if needed.
+ * Return the new block ptr, NULL on failure.
+*/
+static void *huge_resize(void *bp, size_t size) {
+    size_t len = (size + HUGE_HDR + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+    if (len == HUGE_LEN(bp))
+        return bp;
+
+#ifdef THREADS
+    pthread_mutex_lock(&huge_lock);
+#endif
+    char *m = mem_remap((char *)bp - HUGE_HDR, len);
+#ifdef THREADS
+    pthread_mutex_unlock(&huge_lock);
+#endif
+    if (m == NULL)
+        return NULL;
+
+    bp = m + HUGE_HDR;
+    HUGE_LEN(bp) = len;
+    return bp;
+}
+
+/**
+ * huge_free - unmap a huge block
+*/
+static void huge_free(void *bp) {
+#ifdef THREADS
+    pthread_mutex_lock(&huge_lock);
+#endif
+    mem_unmap((char *)bp - HUGE_HDR);
+#ifdef THREADS
+    pthread_mutex_unlock(&huge_lock);
+#endif
+}
+#endif
+
+/**
+ * tail_free_size - size of the free block just before the epilogue,
+ * 0 if that block is allocated.
+*/
+static size_t tail_free_size(void) {
+    if (GET_PALLOC(ar->epi_hdr))
+        return 0;
+    return GET_SIZE((char *)(ar->epi_hdr) - WSIZE); /* footer of the tail block */
+}
+
+/**
+ * trim_heap - give the free tail of the heap back to memlib
+ * once it is larger than TRIM_MAX, keeping TRIM_PAD bytes of it
+ * (the gap between the two keeps free/malloc from trimming and
+ * extending the heap in turn)
+ * 
+ * WILL update the free block lists
+*/
+static void trim_heap(void) {
+    size_t tsize = tail_free_size();
+    if (tsize < TRIM_MAX)
+        return;
+
+    vb_printf("\ttrim_heap(): will trim %#lx\n", tsize - TRIM_PAD);
+
+    void *bp = (char *)(ar->epi_hdr) - tsize + WSIZE;
+    int palloc = GET_PALLOC(HDRP(bp));
+    delete_fb(bp);
+    PUT(HDRP(bp), PACK(TRIM_PAD, 0, palloc));
+    PUT(FTRP(bp), PACK(TRIM_PAD, 0, palloc));
+
+    ar->epi_hdr = HDRP(NEXT_BLKP(bp));
+    PUT(ar->epi_hdr, PACK(0, 1, 0)); /* new epilogue header */
+    insert_fb(bp);
+
+    ARENA_TRIM(tsize - TRIM_PAD);
+}
+
+#ifdef PURGE_MIN
+/**
+ * purge_heap - purge the large free blocks that have not been touched
+ * for PURGE_DECAY frees
+*/
+static void purge_heap(void) {
+    vb_printf("\tpurge_heap(): called\n");
+
+    for (int i=size_class(PURGE_MIN); i<N_SIZECLASS; ++i) {
+        if (!CLASS_SET(i))
+            continue;
+#ifdef TREE_CLASS
+        if (i >= TREE_CLASS) {
+            tree_purge(GET(HEAD_OFFP(TREE_CLASS)));
+            break;
+        }
+#endif
+        void *head = HEAD(i), *fbp = head;
+        do {
+            purge_block(fbp);
+            fbp = SUCC(fbp);
+        } while (fbp != head);
+    }
+}
+
+/**
+ * purge_block - give the interior pages of a free block to the system,
+ * if it is large, old enough and not purged yet.
+ * Only header, PRED, SUCC, stamp and footer stay resident,
+ * the purged bit is lost whenever the header is rewritten.
+*/
+static void purge_block(void *fbp) {
+    unsigned int hdr = GET(HDRP(fbp));
+    if ((hdr & PURGED) || GET_SIZE(HDRP(fbp)) < PURGE_MIN ||
+        ar->purge_clock - GET(STAMP_P(fbp)) < PURGE_DECAY)
+        return;
+
+    size_t pagesize = mem_pagesize();
+    char *lo = (char *)(((size_t)STAMP_P(fbp) + WSIZE + pagesize - 1) & ~(pagesize - 1));
+    char *hi = (char *)((size_t)FTRP(fbp) & ~(pagesize - 1));
+    if (hi > lo)
+        mem_purge(lo, hi - lo);
+
+    PUT(HDRP(fbp), hdr | PURGED);
+    PUT(FTRP(fbp), hdr | PURGED);
+}
+#endif
+
+/**
+ * place - allocate a block, return the allocated part
+ * 
+ * WILL update the free block lists.
+ * A large request is carved from the high end of the block
+ * if the block above is large too, so that large blocks stay together
+ * (and coalesce when freed) while small ones take the low ends.
+ * The block above a free one is always allocated (the epilogue has size 0).
+*/
+static void *place(void *bp, size_t asize) {
+    vb_printf("\tplace(%p, %#lx): called\n", bp, asize);
+
+    size_t csize = GET_SIZE(HDRP(bp));
+    // int palloc = GET_PALLOC(HDRP(bp));
+
+    delete_fb(bp);
+
+#ifdef PLACE_HIGH
+    if (asize >= PLACE_HIGH && (csize - asize) >= (2*DSIZE)
+        && GET_SIZE(HDRP(NEXT_BLKP(bp))) >= PLACE_HIGH) { /* split, high end */
+        void *ap = (char *)bp + csize - asize;
+        size_t nsize = GET_SIZE(HDRP(NEXT_BLKP(bp)));
+        PUT(HDRP(NEXT_BLKP(bp)), PACK(nsize, 1, 2));
+        PUT(HDRP(ap), PACK(asize, 1, 0));
+
+        PUT(HDRP(bp), PACK(csize-asize, 0, 2));
+        PUT(FTRP(bp), PACK(csize-asize, 0, 2));
+        insert_fb(bp);
+        return ap;
+    }
+#endif
+
+    if ((csize - asize) >= (2*DSIZE)) { /* split */
+        PUT(HDRP(bp), PACK(asize, 1, 2));
+
+        void *rp = NEXT_BLKP(bp);
+        PUT(HDRP(rp), PACK(csize-asize, 0, 2));
+        PUT(FTRP(rp), PACK(csize-asize, 0, 2));
+
+        insert_fb(rp);
+        
+    } else { /* no split */
+        PUT(HDRP(bp), PACK(csize, 1, 2));
+        size_t nsize = GET_SIZE(HDRP(NEXT_BLKP(bp)));
+        PUT(HDRP(NEXT_BLKP(bp)), PACK(nsize, 1, 2));
+    }
+    return bp;
+}
+
+/**
+ * trim_block - shrink an allocated block to `asize` bytes
+ * 
+ * The tail is split off as a free block if it is large enough,
+ * otherwise the whole block stays allocated.
+ * Also fix the palloc bit of the next block.
+ * 
+ * WILL update the free block lists
+*/
+static void trim_block(void *bp, size_t asize) {
+    vb_printf("\ttrim_block(%p, %#lx): called\n", bp, asize);
+
+    size_t csize = GET_SIZE(HDRP(bp));
+    int palloc = GET_PALLOC(HDRP(bp));
+
+    if ((csize - asize) >= (2*DSIZE)) { /* split */
+        PUT(HDRP(bp), PACK(asize, 1, palloc));
+
+        bp = NEXT_BLKP(bp);
+        PUT(HDRP(bp), PACK(csize-asize, 0, 2));
+        PUT(FTRP(bp), PACK(csize-asize, 0, 2));
+
+        size_t nsize = GET_SIZE(HDRP(NEXT_BLKP(bp)));
+        int nalloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+        PUT(HDRP(NEXT_BLKP(bp)), PACK(nsize, nalloc, 0));
+
+        insert_fb(coalesce(bp));
+
+    } else { /* no split */
+        PUT(HDRP(bp), PACK(csize, 1, palloc));
+
+        size_t nsize = GET_SIZE(HDRP(NEXT_BLKP(bp)));
+        int nalloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+        PUT(HDRP(NEXT_BLKP(bp)), PACK(nsize, nalloc, 2));
+    }
+}
+
+#ifdef TLSF
+/**
+ * size_class - compute the size class of a block of `size` bytes
+ * 
+ * Below 2^FL_SHIFT the classes are 8 bytes apart (first level 0);
+ * above that, each power of two [2^k, 2^(k+1)) is split
+ * into SL_COUNT linear second-level classes.
+*/
+static int size_class(size_t size) {
+    if (size < (1 << FL_SHIFT))
+        return size >> 3;
+
+    int msb = 8 * sizeof(long) - 1 - __builtin_clzl(size);
+    int fl = msb - FL_SHIFT + 1;
+    int sl = (size >> (msb - SL_LOG2)) - SL_COUNT;
+    return fl * SL_COUNT + sl;
+}
+
+/**
+ * tlsf_set_class - mark the i-th size class as non-empty in both levels
+*/
+static void tlsf_set_class(int i) {
+    int fl = i / SL_COUNT, sl = i % SL_COUNT;
+    PUT(SL_BITMAP_P(fl), GET(SL_BITMAP_P(fl)) | (1u << sl));
+    PUT(BITMAP_P, GET(BITMAP_P) | (1u << fl));
+}
+
+/**
+ * tlsf_clear_class - mark the i-th size class as empty,
+ * and its first-level class too if no second-level class is left
+*/
+static void tlsf_clear_class(int i) {
+    int fl = i / SL_COUNT, sl = i % SL_COUNT;
+    PUT(SL_BITMAP_P(fl), GET(SL_BITMAP_P(fl)) & ~(1u << sl));
+    if (GET(SL_BITMAP_P(fl)) == 0)
+        PUT(BITMAP_P, GET(BITMAP_P) & ~(1u << fl));
+}
+
+/**
+ * find_fit - find a proper free block to allocate
+ * 
+ * Use good-fit for TLSF:
+ * round `asize` up to the next class boundary so that
+ * any block in the chosen class fits, then take its head.
+ * Runs in constant time.
+*/
+static void *find_fit(size_t asize) {
+    size_t rsize = asize;
+    if (asize >= (1 << FL_SHIFT)) {
+        int msb = 8 * sizeof(long) - 1 - __builtin_clzl(asize);
+        rsize += (1ul << (msb - SL_LOG2)) - 1;
+    }
+    int i = size_class(rsize);
+    int fl = i / SL_COUNT, sl = i % SL_COUNT;
+
+    if (fl < FL_COUNT) {
+        unsigned int sl_map = GET(SL_BITMAP_P(fl)) & (~0u << sl);
+        if (!sl_map) {
+            /* no fit in this first-level class, try the larger ones */
+            unsigned int fl_map = fl+1 < FL_COUNT ? GET(BITMAP_P) & (~0u << (fl+1)) : 0;
+            if (fl_map) {
+                fl = __builtin_ctz(fl_map);
+                sl_map = GET(SL_BITMAP_P(fl));
+            }
+        }
+        if (sl_map)
+            return HEAD(fl * SL_COUNT + __builtin_ctz(sl_map));
+    }
+
+    /* not found */
+    vb_printf("\tfind_fit(%#lx): not found\n", asize);
+    return NULL;
+}
+#else
+/**
+ * size_class - compute the size class of a block of `size` bytes
+ * 
+ * Class i holds (16 * 2^(i-1), 16 * 2^i], i.e. the bit length of (size-1)/16.
+*/
+static int size_class(size_t size) {
+    size_t x = (size - 1) >> 4;
+    if (x == 0)
+        return 0;
+    int i = 8 * sizeof(long) - __builtin_clzl(x);
+    return MIN(i, N_SIZECLASS-1);
+}
+
+/**
+ * find_fit - find a proper free block to allocate
+ * 
+ * Use first-fit for  segretated free list.
+*/
+static void *find_fit(size_t asize) {
+    int i = size_class(asize);
+#ifdef TREE_CLASS
+    i = MIN(i, TREE_CLASS);
+#endif
+    /* non-empty size classes that may hold a fit */
+    unsigned int mask = GET(BITMAP_P) & (~0u << i);
+    void *head;
+
+    while (mask) {
+        i = __builtin_ctz(mask);
+#ifdef TREE_CLASS
+        if (i == TREE_CLASS) /* the last class, use best-fit */
+            return tree_fit(asize);
+#endif
+        head = HEAD(i);
+
+        if (!GET_ALLOC(HDRP(head)) && asize <= GET_SIZE(HDRP(head)))
+            return head;
+
+        void *fbp = SUCC(head);
+        while (fbp != head) {
+            if (!GET_ALLOC(HDRP(fbp)) && asize <= GET_SIZE(HDRP(fbp)))
+                return fbp;
+            fbp = SUCC(fbp);
+        }
+
+        mask &= mask - 1;
+    }
+
+    /* not found */
+    vb_printf("\tfind_fit(%#lx): not found\n", asize);
+    return NULL;
+}
+#endif
+
+/**
+ * coalesce - coalesce the prev/next blocks if possible
+ * 
+ * WILL delete the coalesced blocks from the list.
+ * NOT add the new block to the list yet.
+*/
+static void *coalesce(void *bp) {
+    size_t prev_alloc = GET_PALLOC(HDRP(bp));
+    size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+    size_t size = GET_SIZE(HDRP(bp));
+
+    if (prev_alloc && next_alloc) {            /* Case 1 */
+        return bp;
+
+    } else if (prev_alloc && !next_alloc) {      /* Case 2 */
+        vb_printf("\tcoalesce(%p): will coalesce next\n", bp);
+
+        size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
+        delete_fb(NEXT_BLKP(bp));
+        PUT(HDRP(bp), PACK(size, 0, prev_alloc));
+        PUT(FTRP(bp), PACK(size, 0, prev_alloc));
+
+    } else if (!prev_alloc && next_alloc) {      /* Case 3 */
+        vb_printf("\tcoalesce(%p): will coalesce prev\n", bp);
+        
+        size += GET_SIZE(HDRP(PREV_BLKP(bp)));
+        int ppalloc = GET_PALLOC(HDRP(PREV_BLKP(bp)));
+        delete_fb(PREV_BLKP(bp));
+        PUT(FTRP(bp), PACK(size, 0, ppalloc));
+        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0, ppalloc));
+
+        bp = PREV_BLKP(bp);
+
+    } else {                                     /* Case 4 */
+        vb_printf("\tcoalesce(%p): will coalesce prev & next\n", bp);
+        
+        size += GET_SIZE(HDRP(PREV_BLKP(bp))) + 
+            GET_SIZE(FTRP(NEXT_BLKP(bp)));
+        int ppalloc = GET_PALLOC(HDRP(PREV_BLKP(bp)));
+        delete_fb(PREV_BLKP(bp));
+        delete_fb(NEXT_BLKP(bp));
+        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0, ppalloc));
+        PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0, ppalloc));
+
+        bp = PREV_BLKP(bp);
+    }
+
+    return bp;
+}
+
+/**
+ * insert_fb - insert a free block to tail of list,
+ * or to its place by address if the lists are sorted
+*/
+static void insert_fb(void *fbp) {
+
+    size_t size = GET_SIZE(HDRP(fbp));
+    int i = size_class(size);
+
+#ifdef PURGE_MIN
+    if (size >= PURGE_MIN)
+        PUT(STAMP_P(fbp), ar->purge_clock);
+#endif
+
+#ifdef TREE_CLASS
+    if (i >= TREE_CLASS) {
+        vb_printf("\t\tinsert_fb(%p): size = %#lx, to tree\n", fbp, size);
+        SET_CLASS(TREE_CLASS);
+        PUT(HEAD_OFFP(TREE_CLASS), tree_insert(GET(HEAD_OFFP(TREE_CLASS)), fbp));
+        return;
+    }
+#endif
+    void *head = HEAD(i);
+
+    vb_printf("\t\tinsert_fb(%p): size = %#lx, head[%d] = %p\n", fbp, size, i, head);
+
+    if (head == NULL) {
+        SET_CLASS(i);
+        PUT(HEAD_OFFP(i), OFFSET(ar->heap_listp, fbp));
+        PUT(PRED_OFFP(fbp), 0);
+        PUT(SUCC_OFFP(fbp), 0);
+
+    } else {
+        /* insert to tail of list, or before the first block above it */
+        void *succ = ar->addr_order ? order_succ(i, fbp) : head;
+        void *pred = PRED(succ);
+        PUT(PRED_OFFP(fbp), OFFSET(fbp, pred));
+        PUT(SUCC_OFFP(pred), OFFSET(pred, fbp));
+        PUT(SUCC_OFFP(fbp), OFFSET(fbp, succ));
+        PUT(PRED_OFFP(succ), OFFSET(succ, fbp));
+        if (ar->addr_order && (char *)fbp < (char *)head)
+            PUT(HEAD_OFFP(i), OFFSET(ar->heap_listp, fbp));
+    }
+    ar->finger[i] = OFFSET(ar->heap_listp, fbp);
+
+#ifdef DEBUG
+    mm_checkheap(__LINE__);
+#endif
+}
+
+/**
+ * delete_fb - delete a free block from list
+*/
+static void delete_fb(void *fbp) {
+    size_t size = GET_SIZE(HDRP(fbp));
+    int i = size_class(size);
+
+#ifdef TREE_CLASS
+    if (i >= TREE_CLASS) {
+        vb_printf("\t\tdelete_fb(%p): size = %#lx, from tree\n", fbp, size);
+        unsigned int root = tree_delete(GET(HEAD_OFFP(TREE_CLASS)), fbp);
+        PUT(HEAD_OFFP(TREE_CLASS), root);
+        if (root == 0)
+            CLEAR_CLASS(TREE_CLASS);
+        return;
+    }
+#endif
+    void *head = HEAD(i);
+
+    vb_printf("\t\tdelete_fb(%p): size = %#lx, head[%d] = %p\n", fbp, size, i, head);
+
+    if (ar->finger[i] == (unsigned int)OFFSET(ar->heap_listp, fbp))
+        ar->finger[i] = 0;
+
+    if (fbp == head) {
+        if (SUCC(fbp) == head) {
+            CLEAR_CLASS(i);
+            PUT(HEAD_OFFP(i), 0);
+            return;
+        }
+
+        PUT(HEAD_OFFP(i), OFFSET(ar->heap_listp, SUCC(fbp)));
+    }
+
+    void *pred = PRED(fbp), *succ = SUCC(fbp);
+    PUT(SUCC_OFFP(pred), OFFSET(pred, succ));
+    PUT(PRED_OFFP(succ), OFFSET(succ, pred));
+}
+
+/**
+ * order_succ - find the block that `fbp` should precede
+ * in the non-empty, address-ordered list of class `i`
+ * 
+ * Blocks below the head or above the tail go to an end at once.
+ * Otherwise walk from whichever of the head, the tail and the finger
+ * (the last block inserted) is nearest in address,
+ * so that frees close to each other cost a few steps.
+ * The walk stops after ORDER_WALK blocks, leaving the list
+ * only nearly sorted rather than letting long lists make it O(n).
+*/
+static void *order_succ(int i, void *fbp) {
+    char *head = HEAD(i), *tail = PRED(head), *p = fbp;
+    if (p < head || p > tail)
+        return head;
+
+    char *start = p - head < tail - p ? head : tail;
+    if (ar->finger[i] != 0) {
+        char *f = (char *)(ar->heap_listp) + ar->finger[i];
+        if ((f < p ? p - f : f - p) < (start < p ? p - start : start - p))
+            start = f;
+    }
+
+    int n = ORDER_WALK;
+    if (start < p) {
+        char *q = SUCC(start);
+        while (q < p && --n > 0)
+            q = SUCC(q);
+        return q;
+    }
+    while (PRED(start) > p && --n > 0)
+        start = PRED(start);
+    return start;
+}
+
+#ifdef QUICK_MAX
+/**
+ * Quick lists of small blocks
+ * 
+ * A freed small block stays allocated in its list,
+ * so it is neither coalesced nor inserted to the segregated lists,
+ * and a request of the same size takes it back in O(1).
+ * Lists are FIFO: reusing the oldest block first keeps the placement
+ * close to that of the segregated lists (LIFO costs 13% util on exhaust.rep).
+ * Blocks are coalesced when their list grows too long,
+ * when the lists hold too many bytes, when a large block is freed,
+ * or before the heap is extended.
+*/
+
+/**
+ * quick_pop - take a block of `asize` bytes from its quick list,
+ * return NULL if the list is empty
+*/
+static void *quick_pop(size_t asize) {
+    int b = asize / DSIZE;
+    void *bp = ar->quick[b];
+    if (bp != NULL) {
+        ar->quick[b] = *(void **)bp;
+        --ar->quick_count[b];
+        ar->quick_bytes -= asize;
+    }
+    return bp;
+}
+
+/**
+ * quick_push - put a freed block to its quick list,
+ * coalescing the list (or all lists) if it is over the bound
+*/
+static void quick_push(void *bp) {
+    size_t size = GET_SIZE(HDRP(bp));
+    int b = size / DSIZE;
+    *(void **)bp = NULL;
+    if (ar->quick[b] == NULL)
+        ar->quick[b] = bp;
+    else
+        *(void **)ar->quick_last[b] = bp;
+    ar->quick_last[b] = bp;
+    ++ar->quick_count[b];
+    ar->quick_bytes += size;
+
+    if (ar->quick_bytes > QUICK_BYTES) {
+        quick_flush();
+        trim_heap();
+    } else if (ar->quick_count[b] > QUICK_COUNT) {
+        quick_release(b);
+        trim_heap();
+    }
+}
+
+/**
+ * quick_release - free all blocks in quick list `b`
+*/
+static void quick_release(int b) {
+    while (ar->quick[b] != NULL) {
+        void *p = ar->quick[b];
+        ar->quick[b] = *(void **)p;
+        --ar->quick_count[b];
+        ar->quick_bytes -= GET_SIZE(HDRP(p));
+        free_block(p);
+    }
+}
+
+/**
+ * quick_flush - free all blocks in quick lists
+*/
+static void quick_flush(void) {
+    for (int b=0; b<QUICK_NBIN; ++b)
+        quick_release(b);
+}
+#endif
+
+#ifdef THREADS
+/**
+ * Arenas
+ * 
+ * Each arena has its own lists, prologue and epilogue in its own region,
+ * threads allocate from their home arenas,
+ * and a block is always freed to the arena owning it.
+*/
+
+/**
+ * arena_home - the arena this thread allocates from
+*/
+static struct arena *arena_home(void) {
+#ifdef ARENA_CPU
+    int cpu = sched_getcpu();
+    return &arenas[cpu < 0 ? 0 : cpu % N_ARENA];
+#else
+    if (home == NULL)
+        home = &arenas[__sync_fetch_and_add(&next_arena, 1) % N_ARENA];
+    return home;
+#endif
+}
+
+/**
+ * free_owned - free a block to the arena owning it,
+ * holding the lock of at most one arena (`*held`, NULL for none) at a time.
+ * Blocks of other arenas than the home one are left to their owners.
+*/
+static void free_owned(void *bp, struct arena **held) {
+    struct arena *a = ARENA_OF(bp);
+    if (a != arena_home()) {
+        remote_push(a, bp);
+        return;
+    }
+    if (a != *held) {
+        if (*held != NULL)
+            UNLOCK();
+        LOCK(a);
+        *held = a;
+    }
+    free_block(bp);
+}
+
+/**
+ * remote_push - hand a block over to the arena `a` owning it without locking,
+ * draining the pending blocks of `a` if there are many and its lock is free
+*/
+static void remote_push(struct arena *a, void *bp) {
+    char *base = mem_region_lo(a - arenas);
+    unsigned long long old = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+    unsigned long long new;
+
+    do {
+        unsigned int top = (unsigned int)old;
+        PUT(SUCC_OFFP(bp), top ? OFFSET(bp, base + top) : 0);
+        new = (((old >> 32) + 1) << 32) | (unsigned int)OFFSET(base, bp);
+    } while (!__atomic_compare_exchange_n(&a->remote, &old, new, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (__atomic_add_fetch(&a->remote_count, 1, __ATOMIC_RELAXED) >= REMOTE_MAX &&
+        pthread_mutex_trylock(&a->lock) == 0) {
+        struct arena *saved = ar;
+        ar = a;
+        ++a->acquired;
+        remote_drain();
+        UNLOCK();
+        ar = saved;
+    }
+}
+
+/**
+ * remote_drain - free all blocks pending in the remote stack of the current arena
+ * 
+ * WILL update the free block lists
+*/
+static void remote_drain(void) {
+    unsigned long long old = __atomic_load_n(&ar->remote, __ATOMIC_RELAXED);
+    if ((unsigned int)old == 0)
+        return;
+
+    /* take the whole stack, keeping the tag */
+    while (!__atomic_compare_exchange_n(&ar->remote, &old, old & ~0xffffffffULL, 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        ;
+    __atomic_store_n(&ar->remote_count, 0, __ATOMIC_RELAXED);
+
+    char *bp = (char *)mem_region_lo(ar - arenas) + (unsigned int)old;
+    while (bp != NULL) {
+        int next = *(int *)(SUCC_OFFP(bp));
+        char *nbp = next ? bp + next : NULL;
+        free_block(bp);
+        bp = nbp;
+    }
+}
+
+/**
+ * Per-thread caches of small blocks
+ * 
+ * Cached blocks stay allocated in the heap, so the fast paths
+ * touch only the cache of this thread and need no lock.
+*/
+
+/**
+ * tcache_key_init - create the key whose destructor flushes caches
+*/
+static void tcache_key_init(void) {
+    pthread_key_create(&tcache_key, tcache_exit);
+}
 
-                /* check if this ptr is in heap */
-                if (!in_heap(ptr)) {
-                    dbg_printf("line %d: fb %p not in heap\n", lineno, ptr);
-                    exit(1);
-                }
-                
-                /* check the consistency of succ-prev pairs */
-                if (SUCC(PRED(ptr)) != ptr) {
-                    dbg_printf("line %d: fb %p not matching its pred\n", lineno, ptr);
-                    exit(1);
-                }
-                if (PRED(SUCC(ptr)) != ptr) {
-                    dbg_printf("line %d: fb %p not matching its succ\n", lineno, ptr);
-                    exit(1);
-                }
+/**
+ * tcache_reset - empty the cache of this thread (when the heap is new)
+*/
+static void tcache_reset(void) {
+    memset(&tcache, 0, sizeof(tcache));
+    tcache.gen = heap_gen;
 
-                ptr = SUCC(ptr);
-            }
-        }
+    pthread_once(&tcache_once, tcache_key_init);
+    pthread_setspecific(tcache_key, &tcache);
+}
+
+/**
+ * tcache_pop - take a block of `asize` bytes from the cache,
+ * refilling a batch from the heap if the bin is empty.
+ * Return NULL on failure.
+*/
+static void *tcache_pop(size_t asize) {
+    if (tcache.gen != heap_gen)
+        tcache_reset();
+
+    int b = asize / DSIZE;
+    void *bp = tcache.bins[b];
+
+    if (bp != NULL) {
+        tcache.bins[b] = *(void **)bp;
+        --tcache.count[b];
+        tcache.bytes -= asize;
+        return bp;
     }
 
-    /* check cnt1-cnt2 consistency */
-    if (cnt1 != cnt2) {
-        dbg_printf("line %d: counts of fbs differ (%lu : %lu)\n", lineno, cnt1, cnt2);
-        exit(1);
+    /* refill: keep the first block, cache the others */
+    LOCK(arena_home());
+    if (ARENA_READY()) {
+        remote_drain();
+        bp = alloc_block(asize);
+    } else {
+        bp = NULL;
+    }
+    for (int k=1; bp != NULL && k<TCACHE_BATCH; ++k) {
+        void *p = alloc_block(asize);
+        if (p == NULL)
+            break;
+        int pb = GET_SIZE(HDRP(p)) / DSIZE;
+        *(void **)p = tcache.bins[pb];
+        tcache.bins[pb] = p;
+        ++tcache.count[pb];
+        tcache.bytes += GET_SIZE(HDRP(p));
     }
+    UNLOCK();
 
+    return bp;
 }
 
+/**
+ * tcache_push - put a freed block to the cache,
+ * flushing blocks to the heap if the bin or the cache gets too large
+*/
+static void tcache_push(void *bp) {
+    if (tcache.gen != heap_gen)
+        tcache_reset();
 
+    size_t size = GET_SIZE(HDRP(bp));
+    int b = size / DSIZE;
+
+    *(void **)bp = tcache.bins[b];
+    tcache.bins[b] = bp;
+    ++tcache.count[b];
+    tcache.bytes += size;
+
+    if (tcache.bytes > TCACHE_BYTES) {
+        tcache_flush();
+    } else if (tcache.count[b] > TCACHE_COUNT) {
+        /* give a batch back from the top of the bin */
+        struct arena *held = NULL;
+        for (int k=0; k<TCACHE_BATCH; ++k) {
+            void *p = tcache.bins[b];
+            tcache.bins[b] = *(void **)p;
+            --tcache.count[b];
+            tcache.bytes -= size;
+            free_owned(p, &held);
+        }
+        UNLOCK();
+    }
+}
 
 /**
- * Helper routines
+ * tcache_flush - give all cached blocks of this thread back to the heap
 */
+static void tcache_flush(void) {
+    struct arena *held = NULL;
+    for (int b=0; b<TCACHE_NBIN; ++b) {
+        while (tcache.bins[b] != NULL) {
+            void *p = tcache.bins[b];
+            tcache.bins[b] = *(void **)p;
+            --tcache.count[b];
+            tcache.bytes -= GET_SIZE(HDRP(p));
+            free_owned(p, &held);
+        }
+    }
+    if (held != NULL)
+        UNLOCK();
+}
 
 /**
- * extend_heap - extend the heap by `words` bytes.
- * Return the block ptr extended. (May coalesced)
+ * tcache_exit - flush the cache of an exiting thread
+*/
+static void tcache_exit(void *arg) {
+    (void)arg;
+    if (tcache.gen == heap_gen)
+        tcache_flush();
+}
+#endif
+
+#ifdef TREE_CLASS
+/**
+ * Best-fit tree (treap) of large free blocks
  * 
- * NOT add the extended block to list yet.
+ * Nodes are ordered by (size, address) and heap-ordered by PRIO,
+ * so the expected depth is O(log n).
+ * Functions take and return the offset of a (sub)tree root.
 */
-static void *extend_heap(size_t words, int palloc) {
-    size_t size = (words%2 ? words+1 : words) * WSIZE;
 
-    void *bp = mem_sbrk(size);
-    if (bp == (void *)-1)
-        return NULL;
+/**
+ * tree_insert - insert free block `fbp` to the tree
+*/
+static unsigned int tree_insert(unsigned int root, void *fbp) {
+    if (root == 0) {
+        PUT(LEFT_OFFP(fbp), 0);
+        PUT(RIGHT_OFFP(fbp), 0);
+        return OFFSET(ar->heap_listp, fbp);
+    }
 
-    PUT(HDRP(bp), PACK(size, 0, palloc));
-    PUT(FTRP(bp), PACK(size, 0, palloc));
-    epi_hdr = HDRP(NEXT_BLKP(bp));
-    PUT(epi_hdr, PACK(0, 1, 0)); /* new epilogue header */
+    char *r = NODE(root);
+    if (TREE_LESS(fbp, r)) {
+        unsigned int l = tree_insert(GET(LEFT_OFFP(r)), fbp);
+        char *ln = NODE(l);
+        if (PRIO(ln) > PRIO(r)) { /* rotate right */
+            PUT(LEFT_OFFP(r), GET(RIGHT_OFFP(ln)));
+            PUT(RIGHT_OFFP(ln), root);
+            return l;
+        }
+        PUT(LEFT_OFFP(r), l);
+    } else {
+        unsigned int rt = tree_insert(GET(RIGHT_OFFP(r)), fbp);
+        char *rn = NODE(rt);
+        if (PRIO(rn) > PRIO(r)) { /* rotate left */
+            PUT(RIGHT_OFFP(r), GET(LEFT_OFFP(rn)));
+            PUT(LEFT_OFFP(rn), root);
+            return rt;
+        }
+        PUT(RIGHT_OFFP(r), rt);
+    }
+    return root;
+}
+
+/**
+ * tree_delete - delete free block `fbp` (must be in the tree)
+ * 
+ * Must be called before the size of `fbp` changes.
+*/
+static unsigned int tree_delete(unsigned int root, void *fbp) {
+    char *r = NODE(root);
 
-    vb_printf("\textend_heap(%#lx): epi_hdr = %p\n", words, epi_hdr);
+    if (r == fbp)
+        return tree_merge(GET(LEFT_OFFP(r)), GET(RIGHT_OFFP(r)));
 
-    return coalesce(bp);
+    if (TREE_LESS(fbp, r))
+        PUT(LEFT_OFFP(r), tree_delete(GET(LEFT_OFFP(r)), fbp));
+    else
+        PUT(RIGHT_OFFP(r), tree_delete(GET(RIGHT_OFFP(r)), fbp));
+    return root;
 }
 
 /**
- * place - allocate a block
- * 
- * WILL update the free block lists
+ * tree_merge - merge two trees, every node of `a` sorting before `b`
 */
-static void place(void *bp, size_t asize) {
-    vb_printf("\tplace(%p, %#lx): called\n", bp, asize);
+static unsigned int tree_merge(unsigned int a, unsigned int b) {
+    if (a == 0)
+        return b;
+    if (b == 0)
+        return a;
+
+    char *an = NODE(a), *bn = NODE(b);
+    if (PRIO(an) > PRIO(bn)) {
+        PUT(RIGHT_OFFP(an), tree_merge(GET(RIGHT_OFFP(an)), b));
+        return a;
+    } else {
+        PUT(LEFT_OFFP(bn), tree_merge(a, GET(LEFT_OFFP(bn))));
+        return b;
+    }
+}
 
-    size_t csize = GET_SIZE(HDRP(bp));
-    // int palloc = GET_PALLOC(HDRP(bp));
+/**
+ * tree_fit - find the smallest block of at least `asize` bytes
+ * (the lowest address among equal sizes)
+*/
+static void *tree_fit(size_t asize) {
+    char *fbp = NODE(GET(HEAD_OFFP(TREE_CLASS))), *best = NULL;
+
+    while (fbp != NULL) {
+        if (GET_SIZE(HDRP(fbp)) >= asize) {
+            best = fbp;
+            fbp = NODE(GET(LEFT_OFFP(fbp)));
+        } else {
+            fbp = NODE(GET(RIGHT_OFFP(fbp)));
+        }
+    }
+    return best;
+}
 
-    delete_fb(bp);
+#ifdef PURGE_MIN
+/**
+ * tree_purge - purge the blocks in the subtree `root`
+*/
+static void tree_purge(unsigned int root) {
+    void *node = NODE(root);
+    if (node == NULL)
+        return;
+    tree_purge(GET(LEFT_OFFP(node)));
+    purge_block(node);
+    tree_purge(GET(RIGHT_OFFP(node)));
+}
+#endif
 
-    if ((csize - asize) >= (2*DSIZE)) { /* split */
-        PUT(HDRP(bp), PACK(asize, 1, 2));
+/**
+ * tree_check - check the order and priorities of the tree,
+ * all nodes lying between `lo` and `hi` (NULL for no bound).
+ * Return the number of nodes.
+*/
+static size_t tree_check(unsigned int root, void *lo, void *hi, int lineno) {
+    char *r = NODE(root);
+    if (r == NULL)
+        return 0;
 
-        bp = NEXT_BLKP(bp);
-        PUT(HDRP(bp), PACK(csize-asize, 0, 2));
-        PUT(FTRP(bp), PACK(csize-asize, 0, 2));
+    if (!in_heap(r) || GET_ALLOC(HDRP(r)) || size_class(GET_SIZE(HDRP(r))) < TREE_CLASS) {
+        dbg_printf("line %d: tree node %p invalid\n", lineno, r);
+        exit(1);
+    }
+    if ((lo != NULL && !TREE_LESS(lo, r)) || (hi != NULL && !TREE_LESS(r, hi))) {
+        dbg_printf("line %d: tree node %p out of order\n", lineno, r);
+        exit(1);
+    }
 
-        insert_fb(bp);
-        
-    } else { /* no split */
-        PUT(HDRP(bp), PACK(csize, 1, 2));
-        size_t nsize = GET_SIZE(HDRP(NEXT_BLKP(bp)));
-        PUT(HDRP(NEXT_BLKP(bp)), PACK(nsize, 1, 2));
+    char *ln = NODE(GET(LEFT_OFFP(r))), *rn = NODE(GET(RIGHT_OFFP(r)));
+    if ((ln != NULL && PRIO(ln) > PRIO(r)) || (rn != NULL && PRIO(rn) > PRIO(r))) {
+        dbg_printf("line %d: tree node %p priority error\n", lineno, r);
+        exit(1);
     }
+
+    return 1 + tree_check(GET(LEFT_OFFP(r)), lo, r, lineno) +
+        tree_check(GET(RIGHT_OFFP(r)), r, hi, lineno);
 }
+#endif
 
 /**
- * find_fit - find a proper free block to allocate
+ * Aligned blocks
  * 
- * Use first-fit for  segretated free list.
+ * An aligned block is an ordinary block whose payload happens to be
+ * aligned: the leading gap of the free block it is carved from
+ * becomes a free block of its own, so free and realloc need nothing special.
 */
-static void *find_fit(size_t asize) {
-    int i = 0;
-    size_t ruler = 2 * DSIZE;
-    while (i < N_SIZECLASS-1 && asize > ruler) {
-        ++i;
-        ruler <<= 1;
-    }
-    void *head;
 
-    while (i < N_SIZECLASS) {
-        head = HEAD(i);
-
-        if (head == NULL) {
-            ++i;
-            continue;
-        }
+/**
+ * align_payload - the first address from payload `bp` on
+ * that is aligned to `align` (a power of 2)
+ * and leaves either no gap or one large enough to be a free block
+*/
+static char *align_payload(char *bp, size_t align) {
+    char *ap = (char *)(((size_t)bp + align - 1) & ~(align - 1));
+    if (ap != bp && ap - bp < 2*DSIZE) /* gap too small to be a block */
+        ap += align;
+    return ap;
+}
 
-        if (!GET_ALLOC(HDRP(head)) && asize <= GET_SIZE(HDRP(head)))
-            return head;
+/**
+ * aligned_fit - find a free block that holds a block of `asize` bytes
+ * with its payload aligned to `align`
+ * 
+ * First-fit over the lists from the class of `asize`, checking the
+ * aligned payload of each block. The tree (and TLSF) are asked
+ * for a block large enough for any alignment.
+*/
+static void *aligned_fit(size_t asize, size_t align) {
+#ifdef TLSF
+    return find_fit(asize + align + 2*DSIZE);
+#else
+    int i = size_class(asize);
+#ifdef TREE_CLASS
+    i = MIN(i, TREE_CLASS);
+#endif
+    unsigned int mask = GET(BITMAP_P) & (~0u << i);
 
-        void *fbp = SUCC(head);
-        while (fbp != head) {
-            if (!GET_ALLOC(HDRP(fbp)) && asize <= GET_SIZE(HDRP(fbp)))
+    while (mask) {
+        i = __builtin_ctz(mask);
+#ifdef TREE_CLASS
+        if (i == TREE_CLASS)
+            return tree_fit(asize + align + 2*DSIZE);
+#endif
+        char *head = HEAD(i), *fbp = head;
+        do {
+            if (!GET_ALLOC(HDRP(fbp)) &&
+                align_payload(fbp, align) + asize <= fbp + GET_SIZE(HDRP(fbp)))
                 return fbp;
             fbp = SUCC(fbp);
-        }
+        } while (fbp != head);
 
-        ++i;
+        mask &= mask - 1;
     }
-
-    /* not found */
-    vb_printf("\tfind_fit(%#lx): not found\n", asize);
     return NULL;
+#endif
 }
 
 /**
- * coalesce - coalesce the prev/next blocks if possible
+ * alloc_aligned - allocate a block of `asize` bytes (adjusted)
+ * whose payload is aligned to `align` (a power of 2).
  * 
- * WILL delete the coalesced blocks from the list.
- * NOT add the new block to the list yet.
+ * Take a free block that holds the aligned block,
+ * or else allocate one large enough for any alignment,
+ * then give back the leading gap and the tail as free blocks.
 */
-static void *coalesce(void *bp) {
-    size_t prev_alloc = GET_PALLOC(HDRP(bp));
-    size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
-    size_t size = GET_SIZE(HDRP(bp));
+static void *alloc_aligned(size_t asize, size_t align) {
+    char *bp = aligned_fit(asize, align);
+    if (bp != NULL)
+        bp = place(bp, GET_SIZE(HDRP(bp))); /* the whole block */
+    else if ((bp = alloc_block(asize + align + 2*DSIZE)) == NULL)
+        return NULL;
 
-    if (prev_alloc && next_alloc) {            /* Case 1 */
-        return bp;
+    char *ap = align_payload(bp, align);
+    if (ap != bp) { /* split off the leading gap */
+        size_t gap = ap - bp;
+        size_t csize = GET_SIZE(HDRP(bp));
+        int palloc = GET_PALLOC(HDRP(bp));
 
-    } else if (prev_alloc && !next_alloc) {      /* Case 2 */
-        vb_printf("\tcoalesce(%p): will coalesce next\n", bp);
+        PUT(HDRP(ap), PACK(csize - gap, 1, 0));
+        PUT(HDRP(bp), PACK(gap, 0, palloc));
+        PUT(FTRP(bp), PACK(gap, 0, palloc));
+        insert_fb(coalesce(bp));
+    }
 
-        size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
-        delete_fb(NEXT_BLKP(bp));
-        PUT(HDRP(bp), PACK(size, 0, prev_alloc));
-        PUT(FTRP(bp), PACK(size, 0, prev_alloc));
+    trim_block(ap, asize);
+    return ap;
+}
 
-    } else if (!prev_alloc && next_alloc) {      /* Case 3 */
-        vb_printf("\tcoalesce(%p): will coalesce prev\n", bp);
-        
-        size += GET_SIZE(HDRP(PREV_BLKP(bp)));
-        int ppalloc = GET_PALLOC(HDRP(PREV_BLKP(bp)));
-        delete_fb(PREV_BLKP(bp));
-        PUT(FTRP(bp), PACK(size, 0, ppalloc));
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0, ppalloc));
+/**
+ * Batches
+*/
 
-        bp = PREV_BLKP(bp);
+/**
+ * carve_run - allocate up to `n` blocks of `asize` bytes from one region:
+ * a free block large enough for all of them (or else the first one
+ * that holds at least one), or a new one at the end of the heap.
+ * Store them in `out`, return how many (0 on error)
+*/
+static size_t carve_run(size_t asize, size_t n, void **out) {
+    n = MIN(n, MAX(BATCH_BYTES / asize, 1));
+    size_t want = n * asize;
+
+    char *bp = find_fit(want);
+    if (bp == NULL) /* fill a smaller region before extending the heap */
+        bp = find_fit(asize);
+    if (bp != NULL)
+        bp = place(bp, GET_SIZE(HDRP(bp))); /* the whole block */
+    else if ((bp = alloc_block(want)) == NULL)
+        return 0;
+
+    /* cut the region into blocks, the last one takes the rest and is trimmed */
+    size_t csize = GET_SIZE(HDRP(bp));
+    size_t cnt = MIN(n, csize / asize);
+    int palloc = GET_PALLOC(HDRP(bp));
+    for (size_t j = 0; j + 1 < cnt; ++j) {
+        PUT(HDRP(bp), PACK(asize, 1, palloc));
+        out[j] = bp;
+        bp += asize;
+        palloc = 2;
+    }
+    PUT(HDRP(bp), PACK(csize - (cnt - 1) * asize, 1, palloc));
+    out[cnt - 1] = bp;
+    trim_block(bp, asize);
+    return cnt;
+}
 
-    } else {                                     /* Case 4 */
-        vb_printf("\tcoalesce(%p): will coalesce prev & next\n", bp);
-        
-        size += GET_SIZE(HDRP(PREV_BLKP(bp))) + 
-            GET_SIZE(FTRP(NEXT_BLKP(bp)));
-        int ppalloc = GET_PALLOC(HDRP(PREV_BLKP(bp)));
-        delete_fb(PREV_BLKP(bp));
-        delete_fb(NEXT_BLKP(bp));
-        PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0, ppalloc));
-        PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0, ppalloc));
+/**
+ * batch_alone - return whether block `bp` cannot be merged with others
+ * by mm_free_batch and must be freed by itself
+*/
+static int batch_alone(void *bp) {
+#ifdef SLAB
+    if (is_slab(bp))
+        return 1;
+#endif
+#ifdef HUGE_MIN
+    if (IS_HUGE(bp))
+        return 1;
+#endif
+#ifdef THREADS
+    if (ARENA_OF(bp) != arena_home())
+        return 1;
+#endif
+    return 0;
+}
 
-        bp = PREV_BLKP(bp);
+/**
+ * sort_ptrs - sort `n` pointers by address, in place
+ * (Shell sort, so that no memory is allocated)
+*/
+static void sort_ptrs(void **a, size_t n) {
+    size_t gap = 1;
+    while (gap < n / 3)
+        gap = 3 * gap + 1;
+    for (; gap > 0; gap /= 3) {
+        for (size_t i = gap; i < n; ++i) {
+            void *p = a[i];
+            size_t j = i;
+            for (; j >= gap && (char *)a[j - gap] > (char *)p; j -= gap)
+                a[j] = a[j - gap];
+            a[j] = p;
+        }
     }
+}
 
-    return bp;
+#ifdef SLAB
+/**
+ * Slab allocator for small requests
+*/
+
+/**
+ * is_slab - return whether `p` points into a slab page
+*/
+static int is_slab(const void *p) {
+    size_t idx = (size_t)(SLAB_OF(p) - SLAB_OF(ar->heads)) >> SLAB_SHIFT;
+    return idx < slab_map_pages && ((slab_map[idx >> 3] >> (idx & 7)) & 1);
 }
 
 /**
- * insert_fb - insert a free block to tail of list
+ * slab_map_set - mark the page of slab `sp` as slab page or not.
+ * Grow the bitmap of slab pages if it does not cover `sp`.
+ * Return -1 on error, 0 on success.
 */
-static void insert_fb(void *fbp) {
+static int slab_map_set(void *sp, int val) {
+    size_t idx = (size_t)((char *)sp - SLAB_OF(ar->heads)) >> SLAB_SHIFT;
+
+    if (idx >= slab_map_pages) { /* grow the bitmap (a regular block) */
+        size_t pages = MAX(2 * slab_map_pages, 2 * (mem_heapsize() >> SLAB_SHIFT));
+        pages = (MAX(pages, idx + 1) + 63) & ~(size_t)63;
+
+        unsigned char *map = alloc_block(MAX(ALIGN(pages / 8 + WSIZE), 2*DSIZE));
+        if (map == NULL)
+            return -1;
+        memset(map, 0, pages / 8);
+        if (slab_map != NULL)
+            memcpy(map, slab_map, slab_map_pages / 8);
+
+        unsigned char *old = slab_map;
+        slab_map = map;
+        slab_map_pages = pages;
+        if (old != NULL)
+            free(old);
+    }
 
-    size_t size = GET_SIZE(HDRP(fbp));
-    int i = 0;
-    size_t ruler = 2 * DSIZE;
-    while (i < N_SIZECLASS-1 && size > ruler) {
-        ++i;
-        ruler <<= 1;
+    if (val)
+        slab_map[idx >> 3] |= 1 << (idx & 7);
+    else
+        slab_map[idx >> 3] &= ~(1 << (idx & 7));
+    return 0;
+}
+
+/**
+ * slab_alloc - allocate a slot from the c-th slab class
+*/
+static void *slab_alloc(int c) {
+    void *np = SLAB_HEAD(c);
+    char *sp = np == NULL ? slab_new(c) : NODE_SLAB(np);
+    if (sp == NULL)
+        return NULL;
+
+    unsigned int off = GET(SLOT_FREEP(sp));
+    if (off) { /* reuse a freed slot */
+        PUT(SLOT_FREEP(sp), GET(sp + off));
+    } else { /* take a never-used slot */
+        off = GET(SLOT_BUMPP(sp));
+        PUT(SLOT_BUMPP(sp), off + GET(SLOT_SIZEP(sp)));
     }
-    void *head = HEAD(i);
+    PUT(SLOT_USEDP(sp), GET(SLOT_USEDP(sp)) + 1);
 
-    vb_printf("\t\tinsert_fb(%p): size = %#lx, head[%d] = %p\n", fbp, size, i, head);
+    if (SLAB_FULL(sp))
+        slab_unlink(sp);
 
-    if (head == NULL) {
-        PUT(HEAD_OFFP(i), OFFSET(heap_listp, fbp));
-        PUT(PRED_OFFP(fbp), 0);
-        PUT(SUCC_OFFP(fbp), 0);
+    return sp + off;
+}
 
-    } else {
-        /* insert to tail of list */
-        void *pred = PRED(head), *succ = head;
-        PUT(PRED_OFFP(fbp), OFFSET(fbp, pred));
-        PUT(SUCC_OFFP(pred), OFFSET(pred, fbp));
-        PUT(SUCC_OFFP(fbp), OFFSET(fbp, succ));
-        PUT(PRED_OFFP(succ), OFFSET(succ, fbp));
+/**
+ * slab_free - free a slot
+ * 
+ * A slab getting empty is given back to the heap,
+ * unless it is the only slab with free slots in its class.
+*/
+static void slab_free(void *p) {
+    char *sp = SLAB_OF(p);
+    int full = SLAB_FULL(sp);
+
+    PUT(p, GET(SLOT_FREEP(sp)));
+    PUT(SLOT_FREEP(sp), OFFSET(sp, p));
+    PUT(SLOT_USEDP(sp), GET(SLOT_USEDP(sp)) - 1);
+
+    if (full) {
+        slab_link(sp);
+    } else if (GET(SLOT_USEDP(sp)) == 0 && SUCC(SLAB_NODE(sp)) != SLAB_NODE(sp)) {
+        vb_printf("\tslab_free(%p): will release slab %p\n", p, sp);
+
+        slab_unlink(sp);
+        slab_map_set(sp, 0);
+        free(sp);
     }
+}
 
-#ifdef DEBUG
-    mm_checkheap(__LINE__);
-#endif
+/**
+ * slab_new - make a new slab page for the c-th slab class,
+ * and add it to the list of the class
+*/
+static void *slab_new(int c) {
+    char *sp = alloc_aligned(SLAB_SIZE, SLAB_SIZE);
+    if (sp == NULL)
+        return NULL;
+    if (slab_map_set(sp, 1) < 0) {
+        free(sp);
+        return NULL;
+    }
+
+    vb_printf("\tslab_new(%d): sp = %p\n", c, sp);
+
+    PUT(SLOT_SIZEP(sp), (c+1) * ALIGNMENT);
+    PUT(SLOT_USEDP(sp), 0);
+    PUT(SLOT_FREEP(sp), 0);
+    PUT(SLOT_BUMPP(sp), SLAB_HDR);
+    slab_link(sp);
+
+    return sp;
 }
 
 /**
- * delete_fb - delete a free block from list
+ * slab_link - insert a slab to the head of the list of its class
 */
-static void delete_fb(void *fbp) {
-    size_t size = GET_SIZE(HDRP(fbp));
-    int i = 0;
-    size_t ruler = 2 * DSIZE;
-    while (i < N_SIZECLASS-1 && size > ruler) {
-        ++i;
-        ruler <<= 1;
+static void slab_link(void *sp) {
+    int c = GET(SLOT_SIZEP(sp)) / ALIGNMENT - 1;
+    void *np = SLAB_NODE(sp);
+    void *head = SLAB_HEAD(c);
+
+    if (head == NULL) {
+        PUT(PRED_OFFP(np), 0);
+        PUT(SUCC_OFFP(np), 0);
+    } else {
+        void *pred = PRED(head), *succ = head;
+        PUT(PRED_OFFP(np), OFFSET(np, pred));
+        PUT(SUCC_OFFP(pred), OFFSET(pred, np));
+        PUT(SUCC_OFFP(np), OFFSET(np, succ));
+        PUT(PRED_OFFP(succ), OFFSET(succ, np));
     }
-    void *head = HEAD(i);
+    PUT(SLAB_HEAD_OFFP(c), OFFSET(ar->heap_listp, np));
+}
 
-    vb_printf("\t\tdelete_fb(%p): size = %#lx, head[%d] = %p\n", fbp, size, i, head);
+/**
+ * slab_unlink - delete a slab from the list of its class
+*/
+static void slab_unlink(void *sp) {
+    int c = GET(SLOT_SIZEP(sp)) / ALIGNMENT - 1;
+    void *np = SLAB_NODE(sp);
 
-    if (fbp == head) {
-        if (SUCC(fbp) == head) {
-            PUT(HEAD_OFFP(i), 0);
+    if (np == SLAB_HEAD(c)) {
+        if (SUCC(np) == np) {
+            PUT(SLAB_HEAD_OFFP(c), 0);
             return;
         }
-
-        PUT(HEAD_OFFP(i), OFFSET(heap_listp, SUCC(fbp)));
+        PUT(SLAB_HEAD_OFFP(c), OFFSET(ar->heap_listp, SUCC(np)));
     }
 
-    void *pred = PRED(fbp), *succ = SUCC(fbp);
+    void *pred = PRED(np), *succ = SUCC(np);
     PUT(SUCC_OFFP(pred), OFFSET(pred, succ));
     PUT(PRED_OFFP(succ), OFFSET(succ, pred));
 }
+#endif
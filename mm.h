@@ -7,6 +7,9 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc (size_t nmemb, size_t size);
+extern void *mm_memalign(size_t align, size_t size);
+extern void *mm_aligned_alloc(size_t align, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t align, size_t size);
 
 #else
 
@@ -15,6 +18,9 @@ extern void *malloc (size_t size);
 extern void free (void *ptr);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc (size_t nmemb, size_t size);
+extern void *memalign(size_t align, size_t size);
+extern void *aligned_alloc(size_t align, size_t size);
+extern int posix_memalign(void **memptr, size_t align, size_t size);
 
 #endif
 
@@ -22,3 +28,44 @@ extern int mm_init(void);
 
 /* This is largely for debugging. */
 extern void mm_checkheap(int lineno);
+
+/* Allocate `n` blocks of `size` bytes into `out` from as few free regions
+ * as possible; returns how many were allocated. */
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+
+/* Free the `n` blocks in `ptrs` (sorted in place), merging adjacent ones. */
+extern void mm_free_batch(void **ptrs, size_t n);
+
+/* Regions: objects allocated by a bump pointer (without headers) in chunks
+ * taken from the heap, and released all at once by reset or destroy.
+ * A region itself is not thread-safe. */
+struct mm_region;
+extern struct mm_region *mm_region_create(void);
+extern void *mm_region_alloc(struct mm_region *r, size_t size);
+extern void mm_region_reset(struct mm_region *r);
+extern void mm_region_destroy(struct mm_region *r);
+
+/* Pools: objects of one size (without headers) in slabs taken from the heap;
+ * a slab left empty goes back to the heap. A pool is not thread-safe. */
+struct mm_pool;
+struct mm_pool_stats {
+    size_t objsize; /* bytes per object */
+    size_t slabs; /* slabs held */
+    size_t bytes; /* bytes of the heap they take */
+    size_t inuse; /* objects allocated */
+    size_t capacity; /* objects the slabs can hold */
+    unsigned long allocs, frees; /* calls so far */
+};
+extern struct mm_pool *mm_pool_create(size_t objsize, size_t align);
+extern void *mm_pool_alloc(struct mm_pool *p);
+extern void mm_pool_free(struct mm_pool *p, void *obj);
+extern void mm_pool_stats(const struct mm_pool *p, struct mm_pool_stats *st);
+extern void mm_pool_destroy(struct mm_pool *p);
+
+/* Counters of the heap lock, to measure contention (thread-safe build). */
+extern void mm_lock_stats(unsigned long *acquired, unsigned long *contended);
+
+/* Free-list insertion of the heaps set up by later calls to mm_init:
+ * nonzero keeps each list sorted by address, 0 appends to its tail.
+ * Returns the previous setting. */
+extern int mm_set_order(int addr);